@@ -10,28 +10,191 @@
 #define DEBUG 0
 
 #define EEPROM_ADDR (0x20)
-#define EEPROM_MAX  (64)			// max size of a config block
+#define CONFIG_IDS  (32)			// size of the module id lookup table
 
 static Configured  **configs = 0;			// list of modules, each implementing Configured
 static uint8_t     config_cnt = 0;		// number of modules
 static uint16_t    config_sz = 0;			// total size of configs in eeprom
 
-static bool check_crc(void) {
-	uint8_t *eeprom_addr = (uint8_t *)EEPROM_ADDR;
-	uint16_t crc = ~0;
-	for (uint16_t i=0; i<config_sz; i++)
-		crc = _crc16_update(crc, eeprom_read_byte(eeprom_addr + i));
-  return crc == 0;
-}
+// Module id lookup table, indexed by the low 5 bits of the id, which tells the real module ids
+// (1..31) and the network layer's pseudo ids (0xF0..0xFF) apart. Each entry is the index of
+// the module in configs plus one, 0 if none. Ids that share an entry are found by a search.
+static uint8_t     config_ids[CONFIG_IDS];
+
+// ===== EEPROM journal =====
+// The config blocks are kept in a journal so the modules that write their config often, such
+// as OwScan, don't wear out the same EEPROM cells. The EEPROM from EEPROM_ADDR on is split
+// into two banks, one of which is active. A bank starts with its 16-bit generation number and
+// the complement of it, followed by records: module id, config version, size, config block,
+// and a CRC-16 of the generation and all of that. config_write() appends a record to the
+// active bank and the last record of a module is its config. When the bank is full the last record of
+// each module is copied to the other bank, which becomes the active one once its header is
+// written with the next generation. A power loss thus loses at most the record being written.
+// A bank is read up to the first record that doesn't check out, the records left over from
+// its previous use fail the CRC since they have an older generation. A record with another
+// version or size than the module's config is from an older firmware, config_init() has the
+// module migrate it, until then it's carried over as is. config_write_batch() writes several
+// blocks atomically by compacting with all of them.
+
+#define BANK_SZ     ((E2END+1-EEPROM_ADDR)/2)
+#define BANK_HDR    4                     // generation, ~generation
+#define REC_HDR     3                     // module id, version, size
+#define REC_SZ(sz)  (REC_HDR+(sz)+2)      // header, block, CRC
 
-static void write_crc(void) {
-  uint8_t *eeprom_addr = (uint8_t *)EEPROM_ADDR;
+static uint8_t     *bank;                 // active bank
+static uint8_t     *bank_end;             // where the next record goes
+static uint16_t    gen;                   // generation of the active bank
+
+// CRC of a record whose config block is in RAM
+static uint16_t rec_crc(uint8_t *hdr, uint8_t *data) {
   uint16_t crc = ~0;
-  for (uint16_t i=0; i<config_sz-2; i++)
-    crc = _crc16_update(crc, eeprom_read_byte(eeprom_addr + i));
-  eeprom_write_word((uint16_t*)(eeprom_addr+config_sz-2), crc);
+  crc = _crc16_update(crc, gen);
+  crc = _crc16_update(crc, gen >> 8);
+  for (uint8_t i=0; i<REC_HDR; i++)
+    crc = _crc16_update(crc, hdr[i]);
+  for (uint8_t i=0; i<hdr[2]; i++)
+    crc = _crc16_update(crc, data[i]);
+  return crc;
+}
+
+// Write to EEPROM only the bytes that change, an EEPROM write takes ~3.3ms and wears the cell
+static void eeprom_update(uint8_t *addr, uint8_t *data, uint8_t len) {
+  for (uint8_t i=0; i<len; i++)
+    if (eeprom_read_byte(addr+i) != data[i])
+      eeprom_write_byte(addr+i, data[i]);
 }
 
+// Read the generation of a bank, returns false if its header isn't valid
+static bool bank_gen(uint8_t *b, uint16_t *g) {
+  *g = eeprom_read_word((uint16_t *)b);
+  return (uint16_t)~eeprom_read_word((uint16_t *)(b+2)) == *g;
+}
+
+// Write the header of a bank, the first word written invalidates it, the second validates it
+static void bank_commit(uint8_t *b, uint16_t g) {
+  eeprom_write_word((uint16_t *)b, g);
+  eeprom_write_word((uint16_t *)(b+2), ~g);
+}
+
+// Read the records of the active bank, point each module at its last record
+static void bank_read(void) {
+  for (uint8_t i=0; i<config_cnt; i++)
+    configs[i]->configAddr = 0;
+  uint8_t *p = bank + BANK_HDR;
+  uint8_t hdr[REC_HDR], block[EEPROM_MAX];
+  while (p + REC_SZ(0) <= bank + BANK_SZ) {
+    eeprom_read_block(hdr, p, REC_HDR);
+    uint8_t sz = hdr[2];
+    if (sz > EEPROM_MAX || p + REC_SZ(sz) > bank + BANK_SZ) break;
+    eeprom_read_block(block, p+REC_HDR, sz);
+    if (eeprom_read_word((uint16_t *)(p+REC_HDR+sz)) != rec_crc(hdr, block)) break;
+    Configured *cf = config_find(hdr[0]);
+    if (cf && cf->configSize > 0) cf->configAddr = p+REC_HDR;
+    p += REC_SZ(sz);
+  }
+  bank_end = p;
+}
+
+// Whether the last record of a module has the version and size of its config
+static bool rec_current(Configured *cf) {
+  return cf->configAddr != 0 &&
+    eeprom_read_byte(cf->configAddr-2) == cf->configVersion &&
+    eeprom_read_byte(cf->configAddr-1) == cf->configSize;
+}
+
+// Append a record to the active bank, returns the address of its config block
+static uint8_t *bank_append(uint8_t *hdr, uint8_t *data) {
+  uint16_t crc = rec_crc(hdr, data);
+  uint8_t *p = bank_end;
+  eeprom_update(p, hdr, REC_HDR);
+  eeprom_update(p+REC_HDR, data, hdr[2]);
+  eeprom_update(p+REC_HDR+hdr[2], (uint8_t *)&crc, 2);
+  bank_end += REC_SZ(hdr[2]);
+  return p+REC_HDR;
+}
+
+// Find the block of a module in a batch of records: module id, size, block
+static uint8_t *batch_find(uint8_t *batch, uint16_t len, uint8_t id) {
+  for (uint16_t i=0; i+2 <= len; i += 2+batch[i+1])
+    if (batch[i] == id) return batch+i+2;
+  return 0;
+}
+
+// Copy the last record of each module to the other bank, with new blocks for module cf and
+// for the modules in the batch, and make it the active bank. Records of an older version are
+// copied as is.
+static void bank_compact(Configured *cf, uint8_t *data, uint8_t *batch, uint16_t len) {
+  bank = bank == (uint8_t *)EEPROM_ADDR ? bank + BANK_SZ : (uint8_t *)EEPROM_ADDR;
+  bank_end = bank + BANK_HDR;
+  gen++;
+  uint8_t hdr[REC_HDR], block[EEPROM_MAX];
+  for (uint8_t i=0; i<config_cnt; i++) {
+    Configured *m = configs[i];
+    uint8_t *src = m == cf ? data : batch_find(batch, len, m->moduleId);
+    if (src) {
+      hdr[0] = m->moduleId; hdr[1] = m->configVersion; hdr[2] = m->configSize;
+    } else if (m->configAddr != 0) {
+      eeprom_read_block(hdr, m->configAddr-REC_HDR, REC_HDR);
+      eeprom_read_block(block, m->configAddr, hdr[2]);
+      src = block;
+    } else {
+      continue;
+    }
+    // config_init() made sure the current configs fit, an old one that doesn't is dropped
+    m->configAddr = bank_end + REC_SZ(hdr[2]) <= bank + BANK_SZ ? bank_append(hdr, src) : 0;
+  }
+  bank_commit(bank, gen);
+}
+
+// Import the configs written by a firmware from before the journal: the blocks of all modules
+// back to back from EEPROM_ADDR on, in the order of the list passed to config_init(), followed
+// by a CRC of all of them. They go into the second bank, which they don't overlap, so a power
+// loss during the import leaves them intact and the next boot starts over. Returns false if
+// there is no such layout, i.e. the CRC doesn't check out with the modules' current sizes.
+static bool legacy_import(void) {
+  uint8_t *p = (uint8_t *)EEPROM_ADDR;
+  uint16_t sz = 2, crc = ~0;
+  for (uint8_t i=0; i<config_cnt; i++)
+    sz += configs[i]->configSize;
+  for (uint16_t i=0; i<sz; i++)
+    crc = _crc16_update(crc, eeprom_read_byte(p+i));
+  if (crc != 0) return false;
+  bank = p + BANK_SZ; bank_end = bank + BANK_HDR; gen = 0;
+  uint8_t hdr[REC_HDR], block[EEPROM_MAX];
+  for (uint8_t i=0; i<config_cnt; i++) {
+    Configured *m = configs[i];
+    if (m->configSize == 0) continue;
+    // the blocks had no version, they're the first layout of each module
+    hdr[0] = m->moduleId; hdr[1] = 0; hdr[2] = m->configSize;
+    eeprom_read_block(block, p, hdr[2]);
+    bank_append(hdr, block);
+    p += hdr[2];
+  }
+  bank_commit(bank, gen);
+  // the old blocks could happen to look like a newer header of the first bank
+  eeprom_write_word((uint16_t *)(EEPROM_ADDR+2), eeprom_read_word((uint16_t *)EEPROM_ADDR));
+  return true;
+}
+
+// Find the active bank and read it, import the configs of an older firmware if the EEPROM has
+// neither, or else start with an empty bank
+static void bank_init(void) {
+  uint16_t g0, g1;
+  uint8_t *b0 = (uint8_t *)EEPROM_ADDR, *b1 = b0 + BANK_SZ;
+  bool v0 = bank_gen(b0, &g0), v1 = bank_gen(b1, &g1);
+  if (v0 && (!v1 || (int16_t)(g0 - g1) > 0)) {
+    bank = b0; gen = g0;
+  } else if (v1) {
+    bank = b1; gen = g1;
+  } else if (legacy_import()) {
+    Serial.println(F("  EEPROM imported"));
+  } else {
+    Serial.println(F("  EEPROM not initialized"));
+    bank = b0; gen = 0;
+    bank_commit(bank, gen);
+  }
+  bank_read();
+}
 
 void config_init(Configured **cf) {
 	// count the number of configs
@@ -42,43 +205,69 @@ void config_init(Configured **cf) {
   Serial.print(config_cnt);
   Serial.print(F(" configs "));
 
-	// iterate through modules to calculate total size in EEPROM
-	config_sz = 0;
+	// iterate through modules to size their configs in EEPROM and fill the lookup table
+	config_sz = BANK_HDR;
+	memset(config_ids, 0, sizeof(config_ids));
 	for (uint8_t i=0; i<config_cnt; i++) {
+		uint8_t *id = &config_ids[cf[i]->moduleId % CONFIG_IDS];
+		if (*id == 0) *id = i+1;
 		uint8_t sz = cf[i]->configSize;
-		if (sz > EEPROM_MAX) {
+		if (sz > EEPROM_MAX || config_sz + REC_SZ(sz) > BANK_SZ) {
       Serial.println();
 			Serial.print(F("CONFIG: the config for module #"));
       Serial.print(i+1); Serial.print(F(" is too large ("));
 			Serial.print(sz); Serial.print(F(" vs. "));
-      Serial.print(EEPROM_MAX); Serial.println(F(" max)"));
-			continue;
+			if (sz > EEPROM_MAX) {
+        Serial.print(EEPROM_MAX); Serial.println(F(" max)"));
+			} else {
+        // the bank has to hold a record for each module
+        int16_t left = BANK_SZ - config_sz - REC_SZ(0);
+        Serial.print(left > 0 ? left : 0); Serial.println(F(" left in the EEPROM bank)"));
+			}
+			cf[i]->configSize = sz = 0;
 		}
-		config_sz += sz;
+		if (sz > 0) config_sz += REC_SZ(sz);
 	}
-	config_sz += 2; // CRC
   Serial.print(config_sz);
   Serial.println(F(" bytes"));
-
-	// check CRC
-  if (!check_crc()) {
-		// give each module's applyConfig a rain-check
-    Serial.println(F("  CRC does not match!"));
-		for (uint8_t i=0; i<config_cnt; i++) {
-      //Serial.print(F("Raincheck for module "));
-      //Serial.println(i);
-			cf[i]->applyConfig(0);
-    }
-		return;
-	}
-  Serial.println(F("  CRC matches!"));
+	bank_init();
 
 	// read each config and pass to applyConfig
 	uint8_t config_block[EEPROM_MAX];
-	uint8_t *eeprom_addr = (uint8_t *)EEPROM_ADDR;
 	for (uint8_t i=0; i<config_cnt; i++) {
-		// read from eeprom
-		eeprom_read_block(config_block, eeprom_addr, cf[i]->configSize);
+		// modules without a config, also those whose config didn't fit, get none
+		if (cf[i]->configSize == 0) {
+			cf[i]->applyConfig(0);
+			continue;
+		}
+		// give the module's applyConfig a rain-check if it has no valid record
+		if (cf[i]->configAddr == 0) {
+      Serial.print(F("  no config for module "));
+      Serial.println(cf[i]->moduleId);
+			cf[i]->applyConfig(0);
+			continue;
+		}
+		// read from eeprom, have the module migrate a config written by an older firmware
+		if (!rec_current(cf[i])) {
+			uint8_t version = eeprom_read_byte(cf[i]->configAddr-2);
+			uint8_t sz = eeprom_read_byte(cf[i]->configAddr-1);
+			eeprom_read_block(config_block, cf[i]->configAddr, sz);
+			if (sz < cf[i]->configSize) memset(config_block+sz, 0, cf[i]->configSize-sz);
+      Serial.print(F("  migrating config of module "));
+      Serial.print(cf[i]->moduleId);
+      Serial.print(F(" from version "));
+      Serial.print(version);
+			if (!cf[i]->migrateConfig(version, sz, config_block)) {
+        Serial.println(F(" failed"));
+				cf[i]->configAddr = 0;
+				cf[i]->applyConfig(0);
+				continue;
+			}
+      Serial.println();
+			config_write(cf[i]->moduleId, config_block);
+		} else {
+			eeprom_read_block(config_block, cf[i]->configAddr, cf[i]->configSize);
+		}
 #if DEBUG
     Serial.print(F("  applyConfig for module "));
     Serial.print(cf[i]->moduleId);
@@ -91,11 +280,34 @@ void config_init(Configured **cf) {
 #endif
 		// call applyConfig
 		cf[i]->applyConfig(config_block);
-    eeprom_addr += cf[i]->configSize;
 	}
 }
 
-void config_dispatch(volatile uint8_t *data, uint8_t len) {
+Configured *config_get(uint8_t i) {
+  return i < config_cnt ? configs[i] : 0;
+}
+
+Configured *config_find(uint8_t module) {
+  uint8_t i = config_ids[module % CONFIG_IDS];
+  if (i == 0) return 0;
+  if (configs[i-1]->moduleId == module) return configs[i-1];
+  // the entry belongs to another module, search
+  for (i=0; i<config_cnt; i++)
+    if (configs[i]->moduleId == module) return configs[i];
+  return 0;
+}
+
+static void dispatch(uint8_t module, volatile uint8_t *pkt, uint16_t len) {
+  Configured *cf = config_find(module);
+  if (cf) cf->receive(pkt, len);
+}
+
+uint8_t Configured::call(volatile uint8_t *pkt, uint8_t len, uint8_t *reply, uint8_t *replyLen) {
+  receive(pkt, len);
+  return RPC_OK;
+}
+
+void config_dispatch(volatile uint8_t *data, uint16_t len) {
   // if data=0 then no args were supplied: use rf12 buffer as default
   if (data == 0) {
     data = rf12_data;
@@ -106,81 +318,98 @@ void config_dispatch(volatile uint8_t *data, uint8_t len) {
   if (len < 1) return;
   uint8_t module = data[0];
 
-	// iterate through modules and dispatch to correct one
-	for (uint8_t i=0; i<config_cnt; i++) {
-		uint8_t m = configs[i]->moduleId;
-		if (m == module) {
-      configs[i]->receive(data+1, len-1);
-      return;
-		}
-	}
+  // an aggregate packet consists of records (module_id, len, payload), dispatch each one
+  if (module == AGG_MODULE) {
+    uint16_t i = 1;
+    while (i+2 <= len && i+2+data[i+1] <= len) {
+      dispatch(data[i], data+i+2, data[i+1]);
+      i += 2+data[i+1];
+    }
+    return;
+  }
+
+  dispatch(module, data+1, len-1);
 }
 
 void config_write(uint8_t module, void *data) {
-  // iterate through modules and sum sizes to get offset for writing
-  uint8_t *eeprom_addr = (uint8_t *)EEPROM_ADDR;
-  for (uint8_t i=0; i<config_cnt; i++) {
-    uint8_t m = configs[i]->moduleId;
-    if (m == module) {
-      // write the config block
+  Configured *cf = config_find(module);
+  if (!cf) {
+    Serial.print(F("Config: module "));
+    Serial.print(module);
+    Serial.println(F(" not found in config_write"));
+    return;
+  }
+  // write the config block
 #if DEBUG
-      Serial.print(F("Config: writing EEPROM @"));
-      Serial.print((long)eeprom_addr);
-      Serial.print(F(" sz="));
-      Serial.print(configs[i]->configSize);
-      Serial.print(F(" for module "));
-      Serial.println(module);
-      Serial.print(F("  data is 0x"));
-      for (byte b=0; b<configs[i]->configSize; b++) {
-        Serial.print(" ");
-        Serial.print(((uint8_t*)data)[b], HEX);
-      }
-      Serial.println();
+  Serial.print(F("Config: writing EEPROM @"));
+  Serial.print((long)cf->configAddr);
+  Serial.print(F(" sz="));
+  Serial.print(cf->configSize);
+  Serial.print(F(" for module "));
+  Serial.println(module);
+  Serial.print(F("  data is 0x"));
+  for (byte b=0; b<cf->configSize; b++) {
+    Serial.print(" ");
+    Serial.print(((uint8_t*)data)[b], HEX);
+  }
+  Serial.println();
 #endif
-      eeprom_write_block(data, eeprom_addr, configs[i]->configSize);
-      // update the CRC
-      write_crc();
-      return;
-    } else {
-      eeprom_addr += configs[i]->configSize;
-    }
+  if (cf->configSize == 0) return;
+  // nothing to write if the block doesn't change
+  if (rec_current(cf)) {
+    uint8_t i = 0;
+    while (i < cf->configSize && eeprom_read_byte(cf->configAddr+i) == ((uint8_t *)data)[i]) i++;
+    if (i == cf->configSize) return;
+  }
+  // append a record, or start over in the other bank if this one is full
+  uint8_t hdr[REC_HDR] = { cf->moduleId, cf->configVersion, cf->configSize };
+  if (bank_end + REC_SZ(cf->configSize) <= bank + BANK_SZ)
+    cf->configAddr = bank_append(hdr, (uint8_t *)data);
+  else
+    bank_compact(cf, (uint8_t *)data, 0, 0);
+}
+
+bool config_write_batch(uint8_t *batch, uint16_t len) {
+  // check that each record is for a module, the only one for it, and has the size of its config
+  for (uint16_t i=0; i<len; i += 2+batch[i+1]) {
+    if (i+2 > len) return false;
+    Configured *cf = config_find(batch[i]);
+    if (!cf || cf->configSize == 0 || batch[i+1] != cf->configSize || i+2+batch[i+1] > len)
+      return false;
+    if (batch_find(batch, i, batch[i])) return false;
   }
-  // oops, module not found
-  Serial.print(F("Config: module "));
-  Serial.print(module);
-  Serial.println(F(" not found in config_write"));
+  // the other bank takes all of them at once when its header is written
+  bank_compact(0, 0, batch, len);
+  return true;
 }
 
 bool config_read(uint8_t module, void *data) {
-  // iterate through modules and sum sizes to get offset for reading
-  uint8_t *eeprom_addr = (uint8_t *)EEPROM_ADDR;
-  for (uint8_t i=0; i<config_cnt; i++) {
-    uint8_t m = configs[i]->moduleId;
-    if (m == module) {
-      // read the config block
-      eeprom_read_block(data, eeprom_addr, configs[i]->configSize);
+  Configured *cf = config_find(module);
+  if (!cf) {
+    Serial.print(F("Config: module "));
+    Serial.print(module);
+    Serial.println(F(" not found in config_read"));
+    return false;
+  }
+  if (cf->configSize == 0) return true;
+  if (!rec_current(cf)) return false;
+  // read the config block
+  eeprom_read_block(data, cf->configAddr, cf->configSize);
 #if DEBUG
-      Serial.print(F("Config: reading EEPROM @"));
-      Serial.print((long)eeprom_addr);
-      Serial.print(F(" sz="));
-      Serial.print(configs[i]->configSize);
-      Serial.print(F(" for module "));
-      Serial.println(module);
-      Serial.print(F("  data is 0x"));
-      for (byte b=0; b<configs[i]->configSize; b++) {
-        Serial.print(" ");
-        Serial.print(((uint8_t*)data)[b], HEX);
-      }
-      Serial.println();
-#endif
-      return true;
-    } else {
-      eeprom_addr += configs[i]->configSize;
-    }
+  Serial.print(F("Config: reading EEPROM @"));
+  Serial.print((long)cf->configAddr);
+  Serial.print(F(" sz="));
+  Serial.print(cf->configSize);
+  Serial.print(F(" for module "));
+  Serial.println(module);
+  Serial.print(F("  data is 0x"));
+  for (byte b=0; b<cf->configSize; b++) {
+    Serial.print(" ");
+    Serial.print(((uint8_t*)data)[b], HEX);
   }
-  // oops, module not found
-  Serial.print(F("Config: module "));
-  Serial.print(module);
-  Serial.println(F(" not found in config_read"));
-  return false;
+  Serial.println();
+#endif
+  uint8_t hdr[REC_HDR] = { cf->moduleId, cf->configVersion, cf->configSize };
+  return eeprom_read_word((uint16_t *)(cf->configAddr + cf->configSize)) ==
+    rec_crc(hdr, (uint8_t *)data);
 }
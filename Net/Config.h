@@ -14,22 +14,86 @@
 #define OWRELAY_MODULE  5
 #define OWSCAN_MODULE   6
 
+// Pseudo module IDs used by the network layer
+#define AGG_MODULE      0xF0  // aggregate of several messages: (module_id, len, payload)*
+#define FRAG_MODULE     0xF1  // fragment of a large message: msg_id, index|last, data
+#define RELAY_MODULE    0xF2  // relayed packet: original header, previous hop|relays<<5, payload
+#define RBCAST_MODULE   0xF3  // reliable broadcast: sequence number, payload; or NACK, heartbeat
+#define RPC_MODULE      0xF4  // RPC request: id, module, op, args; reply: id, module, status, data
+
+// Status of a request made through the RPC layer (see NetRpc.h)
+#define RPC_OK          0     // done, the request has taken effect
+#define RPC_ENOMOD      1     // no such module
+#define RPC_EOP         2     // operation or command not supported by the module
+#define RPC_EARGS       3     // malformed arguments
+#define RPC_ESIZE       4     // the reply doesn't fit into a packet
+#define RPC_EBUSY       5     // can't be done now, try again later
+#define RPC_EFAIL       6     // failed
+
+#define EEPROM_MAX      (64)  // max size of a config block
+
+// Fails to compile if the config block type T is larger than EEPROM_MAX, modules with a fixed
+// size config block use it right after its typedef, others are checked by config_init()
+#define CONFIG_CHECK(T) typedef char T##_exceeds_EEPROM_MAX[sizeof(T) <= EEPROM_MAX ? 1 : -1]
+
 class Configured {
 public:
   //virtual uint8_t moduleId(void) = 0;           // return the module id
   //virtual uint8_t configSize(void) = 0;         // return the size of the eeprom config block
   uint8_t moduleId;
   uint8_t configSize;
+  uint8_t configVersion;                          // version of the layout of the config block
+  bool configResizable;                           // config is a table sized by the sketch
+  uint8_t *configAddr;                            // EEPROM address of the config, 0 if none
+
+  Configured(void) { configVersion = 0; configResizable = false; configAddr = 0; }
 	virtual void applyConfig(uint8_t *) = 0;			// apply the config that was read from EEPROM
-	virtual void receive(volatile uint8_t *pkt, uint8_t len) = 0;  // process a received packet
+	virtual void receive(volatile uint8_t *pkt, uint16_t len) = 0;  // process a received packet
+
+  // Execute a command received through the RPC layer, the default passes it to receive() and
+  // reports success. Modules override it to reply with data or to report errors.
+  // @pkt is the command, i.e. what follows the module id in a packet for receive()
+  // @reply is where the reply data goes, at most NET_MAXDATA-RPC_HDR bytes
+  // @replyLen is set to the length of the reply data, it's 0 on entry
+  // @return RPC_OK or an error status
+  virtual uint8_t call(volatile uint8_t *pkt, uint8_t len, uint8_t *reply, uint8_t *replyLen);
+
+  // Convert a config block written by an older firmware, i.e. with another configVersion or
+  // configSize, to the current layout. A module that changes the layout of its config bumps
+  // configVersion and implements this, the default can't convert anything and the module
+  // gets applyConfig(0) instead. Except for a module that sets configResizable, e.g. one
+  // whose config is an address table with as many entries as the sketch asks for: a block of
+  // the same version and another size keeps the entries that still fit, with empty (zero)
+  // ones added at the end if the table grew.
+  // @version and @size are those of the old block
+  // @cf holds the old block, padded with zeros to configSize, and receives the new one
+  // @return true if the block was converted
+  virtual bool migrateConfig(uint8_t version, uint8_t size, uint8_t *cf) {
+    return configResizable && version == configVersion;
+  }
 };
 
 extern void config_init(Configured **modules);
+// Write a module's config block to EEPROM, nothing is written if it didn't change
 extern void config_write(uint8_t moduleId, void *data);
+// Read a module's config block from EEPROM, returns false if there's no such module or the
+// module has no valid config, i.e. it was never written
 extern bool config_read(uint8_t moduleId, void *data);
 
+// Write the config blocks of several modules at once, either all of them make it to EEPROM or,
+// after a power loss, none. The modules' applyConfig() is not called.
+// @batch is a sequence of records: module id, size, config block
+// @return false if a record isn't for a module, repeats a module, or doesn't have the size of
+// its config, in which case nothing is written
+extern bool config_write_batch(uint8_t *batch, uint16_t len);
+
+// Find a module by its id, returns 0 if there is no such module
+extern Configured *config_find(uint8_t moduleId);
+// Get the i-th module of the list passed to config_init(), returns 0 past the end
+extern Configured *config_get(uint8_t i);
+
 // Dispatch a received packet to the appropriate Configured's receive() method.
 // This is typically called after net.poll, e.g.: "if (net.poll()) config_dispatch();"
-extern void config_dispatch(volatile uint8_t *data=0, uint8_t len=0);
+extern void config_dispatch(volatile uint8_t *data=0, uint16_t len=0);
 
 #endif // CONFIG_H
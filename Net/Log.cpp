@@ -47,12 +47,13 @@ void Log::send(void) {
 #ifndef LOG_NORF12B
 	// Log to the network
 	if (config.rf12 && node_id != NET_GW_NODE) {
-		uint8_t *pkt = net.alloc();
-    //while (!pkt) { (void)net.poll(); pkt = net.alloc(); }
-		if (pkt) {
+		net_handle h = net.alloc(NET_PRIO_BULK);
+    //while (!h) { (void)net.poll(); h = net.alloc(NET_PRIO_BULK); }
+		if (h) {
+			uint8_t *pkt = net.data(h);
 			*pkt = LOG_MODULE;
 			memcpy(pkt+1, buffer, ix);
-			net.send(ix+1, true); // +1 for module_id byte
+			net.send(h, ix+1, true); // +1 for module_id byte
 		} else {
       //Serial.println(F("Log: out of rf12 buffers"));
     }
@@ -86,7 +87,12 @@ size_t Log::write (uint8_t v) {
 
 // ===== Configuration =====
 
-void Log::receive(volatile uint8_t *pkt, uint8_t len) { return; } // this is never called :-)
+void Log::receive(volatile uint8_t *pkt, uint16_t len) { return; } // this is never called :-)
+
+// Log has no commands, its config is changed with an RPC_WRITE request
+uint8_t Log::call(volatile uint8_t *pkt, uint8_t len, uint8_t *reply, uint8_t *replyLen) {
+  return RPC_EOP;
+}
 
 void Log::applyConfig(uint8_t *cf) {
   if (cf) {
@@ -8,8 +8,8 @@
 
 #include <Config.h>
 
-// Assumes JeeLib.h is included for rf12 constants
-#define LOG_MAX (RF12_MAXDATA-1)		// max amount of chars that can be logged in one packet
+// Assumes Net.h is included for the max payload size
+#define LOG_MAX (NET_MAXDATA-1)		// max amount of chars that can be logged in one packet
 
 class Log : public Print, public Configured {
 public:
@@ -21,6 +21,7 @@ public:
     bool	eth:1;		// log to the eth network (gw only!)
     bool	time:1;		// log the time with each packet
   } log_config;
+  CONFIG_CHECK(log_config);
 
 private:
   log_config config, defaults;
@@ -49,7 +50,8 @@ public:
 
   // Configuration methods
 	virtual void applyConfig(uint8_t *);
-	virtual void receive(volatile uint8_t *pkt, uint8_t len);
+	virtual void receive(volatile uint8_t *pkt, uint16_t len);
+	virtual uint8_t call(volatile uint8_t *pkt, uint8_t len, uint8_t *reply, uint8_t *replyLen);
 };
 
 extern Log *logger;
@@ -1,6 +1,5 @@
 // Copyright (c) 2013 Thorsten von Eicken
 //
-// TODO: combine ACKs with responses for packet types that send an immediate response
 // TODO: get initial node_id and config CRC from EEPROM
 
 // Reminder: rf12 header (per JeeLib rf12.cpp)
@@ -14,43 +13,62 @@
 // node 31: reserved for receive-all-packets
 
 // compile-time definitions to select network implementation
-// valid values: NET_NONE, NET_RF12B, NET_SERIAL
-#if !defined(NET_NONE) && !defined(NET_SERIAL)
+// valid values: NET_NONE, NET_RF12B, NET_SERIAL, NET_SIM
+// NET_SIM is a host build for the simulator in sim/, which emulates the rf12 driver
+#if defined(NET_SIM) || (!defined(NET_NONE) && !defined(NET_SERIAL))
 #define NET_RF12B
 #endif
 
-#define RF12_19K
-#ifdef RF12_19K
-// 19Kbps => BW:67khz, dev:45Khz
-#define RF12RATE  0xC611 // 19.1kbps
-#define RF12BW    0x94C1 // VDI:fast,-97dBm,67khz
-#define RF12DEV   0x9820 // 45khz
-#endif
-
 #include <JeeLib.h>
 #include <alloca.h>
 #include <Config.h>
 #include <Net.h>
 #include <Time.h>
+#include <NetTime.h>
+#include <NetFrag.h>
+#include <NetRpc.h>
 
-#ifdef NET_SERIAL
-#include <Base64.h>
-#include <util/crc16.h>
+// data rate presets, see NET_RATE in Net.h; the low 3 bits of RF12DEV are the TX power
+#if NET_RATE == 0
+// 49Kbps => BW:134khz, dev:90khz (the rf12_initialize defaults)
+#define RF12KBPS  "49.2"
+#define RF12BPS   49200
+#define RF12RATE  0xC606 // 49.2kbps
+#define RF12BW    0x94A2 // VDI:fast,-91dBm,134khz
+#define RF12DEV   0x9850 // 90khz
+#elif NET_RATE == 1
+// 19Kbps => BW:67khz, dev:45Khz
+#define RF12KBPS  "19.2"
+#define RF12BPS   19150
+#define RF12RATE  0xC611 // 19.1kbps
+#define RF12BW    0x94C1 // VDI:fast,-97dBm,67khz
+#define RF12DEV   0x9820 // 45khz
+#elif NET_RATE == 2
+// 9.6Kbps => BW:67khz, dev:45Khz
+#define RF12KBPS  "9.6"
+#define RF12BPS   9580
+#define RF12RATE  0xC623 // 9.6kbps
+#define RF12BW    0x94C1 // VDI:fast,-97dBm,67khz
+#define RF12DEV   0x9820 // 45khz
+#else
+#error "NET_RATE must be 0, 1, or 2"
 #endif
 
-// Serial Proto States
-#define SPS_IDLE   0
-#define SPS_START  1 // got start character, reading length
-#define SPS_DATA   3 // got length, reading data
-
-// Packet buffers and retries
-#define NET_RETRY_MS 100
-#define NET_RETRY_MAX  8
+#ifdef NET_SERIAL
+// The serial link has the same interface as the rf12 driver and also receives into rf12_buf,
+// so the code below and the dispatching of received packets work the same for both
+#include <NetSerial.h>
+#define rf12_recvDone  ser_recvDone
+#define rf12_canSend   ser_canSend
+#define rf12_sendStart ser_sendStart
+#endif
 
 // Method for getting RSSI of received packets, this works well by connecting the appropriate
 // capacitor on the RF12B module to the SCL/ADC5/PC5 pin on the JeeNode and placing a 1nF capacitor
 // across that to ground.
+#ifdef NET_RF12B
 #define RSSI_PIN 5       // read using analogRead
+#endif
 
 bool node_enabled;       // global variable that enables/disables all code modules
 uint8_t node_id;         // this node's rf12 ID
@@ -61,88 +79,503 @@ typedef struct {
   bool      enabled;     // whether node is enabled or not
   uint16_t  nodeUuid;    // 16-bit "unique" ID
 } net_config;
+CONFIG_CHECK(net_config);
 
-// Allocate a packet buffer and return a pointer to it
-uint8_t *Net::alloc(void) {
+// Destination of a packet, which is also where its ACK comes from: either the node the
+// packet is addressed to or the gateway for packets sent with our own id as source
+static uint8_t destOf(uint8_t hdr) {
+  return hdr & RF12_HDR_DST ? hdr & RF12_HDR_MASK : NET_GW_NODE;
+}
+
+// Allocate a packet buffer at the tail of the ring and return its handle
+net_handle Net::alloc(uint8_t prio) {
 #ifndef NET_NONE
 	if (!node_enabled || node_id == NET_UNINIT_NODE) return 0;
-  if (bufCnt < NET_PKT) return buf[bufCnt].data;
+  uint8_t i;
+  if (bufCnt < NET_PKT) {
+    i = bufHead + bufCnt;
+    if (i >= NET_PKT) i -= NET_PKT;
+    bufCnt++;
+  } else {
+    // The ring is full, reuse a buffer freed out of order or else evict the oldest
+    // packet queued for a stalled destination or held for a sleeping one (also if it was
+    // sent already) or else the oldest of the lowest priority packets, if that's lower than
+    // ours
+    int8_t j = -1;
+    bool jStalled = false;
+    uint8_t jPrio = 0, jAge = 0;
+    for (uint8_t n=0, k=bufHead; n<bufCnt; n++, k=next(k)) {
+      net_packet *p = &buf[k];
+      if (p->state == NET_FREE) { j = k; break; }
+      if (p->state != NET_READY) continue;
+      uint8_t dest = destOf(p->hdr);
+      bool held = asleep(dest);
+      if (p->sendCnt > 0 && !held) continue;
+      bool st = held || stalled(dest);
+      if (!st && p->prio <= prio) continue;
+      uint8_t age = txSeq - p->order;
+      if (j >= 0) {
+        // prefer stalled, then lowest priority, then oldest
+        if (jStalled != st) { if (jStalled) continue; }
+        else if (!st && jPrio != p->prio) { if (jPrio > p->prio) continue; }
+        else if (jAge >= age) continue;
+      }
+      j = k;
+      jStalled = st;
+      jPrio = p->prio;
+      jAge = age;
+    }
+    if (j < 0) return 0;
+    if (buf[j].state != NET_FREE) {
+      if (jStalled) stats.drops++;
+      else stats.evicts++;
+    }
+    i = j;
+  }
+  buf[i].state = NET_ALLOC;
+  buf[i].prio = prio;
+  return i+1;
 #endif
   return 0;
 }
 
-// send the packet at the top of the queue
-void Net::doSend(void) {
+// free a packet buffer, packets may complete out of order so the head of the ring only
+// advances once the oldest buffer is free
+void Net::release(uint8_t i) {
+  buf[i].state = NET_FREE;
+  while (bufCnt > 0 && buf[bufHead].state == NET_FREE) {
+    bufHead = next(bufHead);
+    bufCnt--;
+  }
+}
+
+// Return an allocated buffer without sending it
+void Net::cancel(net_handle h) {
+  if (h > 0 && h <= NET_PKT && buf[h-1].state == NET_ALLOC) release(h-1);
+}
+
+// Find the link state for a destination
+// @return the entry or null if the destination isn't known
+net_peer *Net::findPeer(uint8_t id) {
+  for (uint8_t i=0; i<NET_PEERS; i++)
+    if (peers[i].id == id) return &peers[i];
+  return 0;
+}
+
+// Whether a packet in the queue is headed for a destination
+bool Net::queued(uint8_t dest) {
+  for (uint8_t n=0, i=bufHead; n<bufCnt; n++, i=next(i))
+    if (buf[i].state == NET_READY && destOf(buf[i].hdr) == dest) return true;
+  return false;
+}
+
+// Find the link state for a destination, replacing the least recently used entry if it's not
+// known. Entries that queued packets are headed for are kept, their sequence numbers and
+// retry state are in use; with NET_PEERS > NET_PKT there's always another one.
+net_peer *Net::getPeer(uint8_t id) {
+  net_peer *pr = findPeer(id);
+  if (!pr) {
+    bool prQueued = false;
+    for (uint8_t i=0; i<NET_PEERS; i++) {
+      net_peer *p = &peers[i];
+      if (p->id == 0) { pr = p; break; }
+      bool q = queued(p->id);
+      if (pr && (q > prQueued ||
+                 (q == prQueued && millis() - p->usedAt <= millis() - pr->usedAt)))
+        continue;
+      pr = p;
+      prQueued = q;
+    }
+    memset(pr, 0, sizeof(net_peer));
+    pr->id = id;
+    pr->retryMax = NET_RETRY_MAX;
+#if NET_WINDOW > 0
+    pr->txSeq = txSeq;
+    pr->txReset = true;
+#endif
+  }
+  pr->usedAt = millis();
+  return pr;
+}
+
+// Update the RTT estimate of a link with a new measurement (in ms)
+void Net::rttSample(net_peer *pr, uint16_t rtt) {
+  if (rtt == 0) rtt = 1;
+  if (rtt > NET_RTO_MAX) rtt = NET_RTO_MAX;
+  if (pr->srtt == 0) {
+    // first sample: srtt=rtt, rttvar=rtt/2
+    pr->srtt = rtt << 3;
+    pr->rttvar = rtt << 1;
+  } else {
+    // srtt += (rtt-srtt)/8, rttvar += (|rtt-srtt|-rttvar)/4, all in scaled arithmetic
+    int16_t delta = rtt - (pr->srtt >> 3);
+    pr->srtt += delta;
+    if (delta < 0) delta = -delta;
+    pr->rttvar += delta - (int16_t)(pr->rttvar >> 2);
+  }
+}
+
+// Retransmission timeout for a link: srtt + 4*rttvar
+uint16_t Net::rto(net_peer *pr) {
+  if (pr->srtt == 0) return NET_RETRY_MS;
+  uint16_t t = (pr->srtt >> 3) + pr->rttvar;
+  if (t < NET_RTO_MIN) t = NET_RTO_MIN;
+  return t > NET_RTO_MAX ? NET_RTO_MAX : t;
+}
+
+// A destination is stalled when a packet to it ran out of retries and it hasn't ACKed
+// anything since
+bool Net::stalled(uint8_t dest) {
+  net_peer *pr = findPeer(dest);
+  return pr && pr->fails > 0;
+}
+
+// A stalled destination is held off until its retry timer expires
+bool Net::heldOff(uint8_t dest) {
+  net_peer *pr = findPeer(dest);
+  return pr && pr->fails > 0 && (int32_t)(millis() - pr->retryAt) < 0;
+}
+
+// Packets to a sleepy node are held until it's heard from, it then listens for NET_RXWIN_MS
+// (half of that is left for sending the packet)
+bool Net::asleep(uint8_t dest) {
+#if NET_SLEEPY > 0
+  net_peer *pr = findPeer(dest);
+  return pr && pr->sleepy && millis() - pr->heardAt > NET_RXWIN_MS/2;
+#else
+  return false;
+#endif
+}
+
+// Whether a transmission may start in slot s of the superframe now, always true while the
+// schedule isn't synchronized and for the gateway
+bool Net::inSlot(uint8_t s) {
+#if NET_TDMA > 0
+  if (node_id == NET_GW_NODE || slotSyncAt == 0 || millis() - slotSyncAt > NET_SYNC_MS)
+    return true;
+  uint16_t pos = (slotPhase + (millis() - slotSyncAt) % NET_FRAME_MS) % NET_FRAME_MS;
+  return pos / NET_SLOT_MS == s && pos % NET_SLOT_MS < NET_SLOT_MS/2;
+#else
+  return true;
+#endif
+}
+
+#if NET_TDMA > 0
+void Net::syncSlots(uint32_t t, uint16_t ms) {
+  // the superframe starts at multiples of NET_FRAME_MS since the epoch
+  slotPhase = ((uint32_t)(t % NET_FRAME_MS) * 1000 + ms) % NET_FRAME_MS;
+  slotSyncAt = millis();
+  if (slotSyncAt == 0) slotSyncAt = 1;
+}
+#endif
+
+// Listen before talk: a packet waits a random number of slots and goes out if the channel
+// is clear then, else the backoff doubles (up to NET_BE_MAX) and the wait starts over. The
+// caller must send right away when this returns true: rf12_canSend has switched the radio
+// from receiving to idle.
+// @return true if a packet can be sent now
+bool Net::clearToSend(void) {
+#if defined(NET_NONE)
+  return false;
+#elif NET_CSMA_SLOT > 0
+  if (backoffAt == 0) {
+    backoffAt = millis() + random(1 << backoffExp) * NET_CSMA_SLOT;
+    if (backoffAt == 0) backoffAt = 1;
+  }
+  if ((int32_t)(millis() - backoffAt) < 0) return false;
+  backoffAt = 0;
+  if (!rf12_canSend()) {
+    stats.busy++;
+    if (backoffExp < NET_BE_MAX) backoffExp++;
+    return false;
+  }
+  backoffExp = NET_BE_MIN;
+  return true;
+#else
+  return rf12_canSend();
+#endif
+}
+
+// Number of packets to a destination that are awaiting an ACK
+uint8_t Net::inFlight(uint8_t dest) {
+  uint8_t cnt = 0;
+  for (uint8_t n=0, i=bufHead; n<bufCnt; n++, i=next(i))
+    if (buf[i].state == NET_READY && buf[i].sendCnt > 0 && destOf(buf[i].hdr) == dest) cnt++;
+  return cnt;
+}
+
+// pick the packet to transmit next: packets go in strict priority order, within a priority
+// destinations are served round-robin, and for each one the oldest packet whose retry timer
+// has expired goes first, else the oldest fresh one if the destination's window has room.
+// A stalled destination only gets a fresh packet once its hold-off timer has expired.
+// @return index into buf or -1 if nothing needs sending right now
+int8_t Net::nextToSend(void) {
+  int8_t best = -1;
+  uint8_t bestKey = 0xFF, bestAge = 0;
+  for (uint8_t n=0, i=bufHead; n<bufCnt; n++, i=next(i)) {
+    net_packet *p = &buf[i];
+    if (p->state != NET_READY) continue;
+    uint8_t dest = destOf(p->hdr);
+    if (asleep(dest)) continue;
+#if NET_TDMA > 0
+    // fresh packets go in our slot, retransmissions in the contention slot
+    if (!inSlot(p->sendCnt > 0 ? 0 : slot)) continue;
+#endif
+    if (p->sendCnt > 0) {
+      if (millis() - p->sendTime < p->timeout) continue;
+    } else {
+      if (heldOff(dest)) continue;
+#if NET_WINDOW > 0
+      if (inFlight(dest) >= NET_WINDOW) continue;
+#else
+      if (inFlight(dest) > 0) continue;
+#endif
+    }
+    // key: priority, distance of the destination from the one served last, retransmissions
+    // first
+    uint8_t key = ((p->prio & 3) << 6) | (((dest - rrDest - 1) & RF12_HDR_MASK) << 1) |
+                  (p->sendCnt > 0 ? 0 : 1);
+    uint8_t age = txSeq - p->order;
+    if (key < bestKey || (key == bestKey && age > bestAge)) {
+      best = i;
+      bestKey = key;
+      bestAge = age;
+    }
+  }
+  return best;
+}
+
+// send packet i of the queue
+void Net::doSend(uint8_t i) {
 #ifndef NET_NONE
-	return;
+  net_packet *p = &buf[i];
+  uint8_t hdr = p->hdr;
+  uint8_t len = p->len;
+  net_peer *pr = 0;
+  bool last = false;
+  if (hdr & RF12_HDR_ACK) {
+    pr = getPeer(destOf(hdr));
+    if (p->sendCnt > 0) stats.retries++;
+#if NET_ADAPT > 0
+    // the packet or its ACK got lost, maybe the signal was too weak
+    if (p->sendCnt > 0 && pr->power > 0) {
+      pr->power--;
+      pr->strong = 0;
+    }
+#endif
+    // The last retry means the link isn't doing well: reduce its retry budget and hold off
+    // sending more to it for a while
+    if (p->sendCnt+1 >= pr->retryMax) {
+      pr->retryMax >>= 1;
+      if (pr->retryMax < NET_RETRY_MIN) pr->retryMax = NET_RETRY_MIN;
+      if (pr->fails < 255) pr->fails++;
+      uint8_t sh = pr->fails-1 < NET_STALL_MAX ? pr->fails-1 : NET_STALL_MAX;
+      pr->retryAt = millis() + ((uint32_t)NET_STALL_MS << sh);
+#if NET_RELAY > 0
+      // rather than giving up on a packet headed for the gateway try another next hop
+      if (reroute(p)) return;
+#endif
+#if NET_WINDOW > 0
+      // still ask for an ACK, without it the receiver wouldn't check for a duplicate, but
+      // don't wait for it
+      last = true;
 #else
-  if (bufCnt > 0) {
-    uint8_t hdr = buf[0].hdr;
-    // Don't ask for an ACK on the last retry
-    if (sendCnt+1 >= NET_RETRY_MAX)
+      // stop-and-wait ACKs carry no sequence number, a late one would be taken for the next
+      // packet
       hdr &= ~RF12_HDR_ACK;
-    // send as broadcast packet without ACK
-#ifdef NET_RF12B
-    rf12_sendStart(hdr, &buf[0].data, buf[0].len);
-#elifdef NET_SERIAL
+#endif
+    }
+  }
+  rrDest = destOf(hdr);
+#if NET_WINDOW > 0
+  // Piggyback a queued ACK for the node we're sending to if there's room, the receiver
+  // treats it as if it had received a separate ACK packet with the same addressing
+  for (uint8_t a=0; a<ackCnt; a++) {
+    if ((acks[a].hdr & (RF12_HDR_DST|RF12_HDR_MASK)) != (hdr & (RF12_HDR_DST|RF12_HDR_MASK)))
+      continue;
+#if NET_RELAY > 0
+    if (acks[a].to) continue; // has no room for the node it's for
+#endif
+    if (len + NET_PIGGY > RF12_MAXDATA) break;
+    uint8_t *t = p->data + len - NET_TRAILER;
+    t[0] = acks[a].rssi; t[1] = acks[a].seq; t[2] = acks[a].bits;
+    t[3] = p->seq; t[4] = NET_TRL_ACK;
+    len += NET_PIGGY;
+    popAck(a);
+    break;
+  }
+#endif
+#if NET_WINDOW > 0
+  if (pr && pr->txReset) p->data[len-1] |= NET_TRL_RESET;
+#endif
+#if NET_SLEEPY > 0
+  if (sleepy) p->data[len-1] |= NET_TRL_SLEEPY;
+  rxUntil = millis() + NET_RXWIN_MS;
+#endif
+  // time packets carry the time at which they're sent
+  if (p->data[0] == NETTIME_MODULE && p->len >= 7+NET_TRAILER) NetTime::stamp(p->data+1);
+#if NET_RBCAST > 0
+  else if (p->data[0] == RBCAST_MODULE && p->data[NET_RB_HDR] == NETTIME_MODULE &&
+           p->len >= NET_RB_HDR+7+NET_TRAILER)
+    NetTime::stamp(p->data+NET_RB_HDR+1);
+#endif
+  setPower(hdr & RF12_HDR_ACK ? destOf(hdr) : 0);
+  rf12_sendStart(hdr, p->data, len);
+#if NET_WINDOW > 0
+  // restore the plain trailer for retransmissions
+  p->data[p->len-2] = p->seq;
+  p->data[p->len-1] = NET_TRL_MAGIC;
 #endif
 
 #if DEBUG
-    Serial.print(F("Net::doSend: "));
-    Serial.print(hdr & RF12_HDR_ACK ? " w/ACK " : " no-ACK ");
-    Serial.print((word)&buf[0].data, 16);
-    Serial.print(":"); Serial.println(len[0]);
-#endif
-    // pop packet from queue if we don't expect an ACK
-    if ((hdr & RF12_HDR_ACK) == 0) {
-      if (bufCnt > 1)
-        memcpy(buf, &buf[1], sizeof(net_packet)*(NET_PKT-1));
-      bufCnt--;
-      sendCnt=0;
-    } else {
-      sendCnt++;
-      sendTime = millis();
-    }
+  Serial.print(F("Net::doSend: "));
+  Serial.print(hdr & RF12_HDR_ACK ? " w/ACK " : " no-ACK ");
+  Serial.print(p->seq);
+  Serial.print(":"); Serial.println(p->len);
+#endif
+  // pop packet from queue if we don't expect an ACK
+  if ((hdr & RF12_HDR_ACK) == 0 || last) {
+    release(i);
+  } else {
+    // exponential backoff plus up to 25% random jitter
+    uint16_t t = rto(pr);
+    for (uint8_t n=p->sendCnt; n>0 && t<NET_RTO_MAX; n--) t <<= 1;
+    if (t > NET_RTO_MAX) t = NET_RTO_MAX;
+    p->timeout = t + random((t>>2)+1);
+    p->sendCnt++;
+    p->sendTime = millis();
   }
 #endif
 }
 
 // Send a new packet, this is what user code should call
-void Net::send(uint8_t len, bool ack) {
+void Net::send(net_handle h, uint8_t len, bool ack) {
 #ifndef NET_NONE
+#if NET_AGG_MS > 0
+  if (h == 0) return;
+  // Net's own packets go out on their own: other nodes overhear aggregates and dispatch their
+  // records, a NET_MODULE reply among them would make each one of them reply in turn
+  bool agg = len > 0 && data(h)[0] != NET_MODULE;
+  // append it to the aggregate being built if it fits, record is (module_id, len, payload)
+  if (agg && aggHandle && aggLen+len+1 <= NET_MAXDATA) {
+    uint8_t *a = data(aggHandle) + aggLen, *d = data(h);
+    a[0] = d[0];
+    a[1] = len-1;
+    memcpy(a+2, d+1, len-1);
+    aggLen += len+1;
+    aggCnt++;
+    aggAck |= ack;
+    // the aggregate goes out with the highest priority of its records
+    if (buf[h-1].prio < buf[aggHandle-1].prio) buf[aggHandle-1].prio = buf[h-1].prio;
+    cancel(h);
+    if (aggLen+3 > NET_MAXDATA) aggFlush();
+    return;
+  }
+  aggFlush();
+  // start a new aggregate in this packet's buffer if there's room for more
+  if (agg && len+2+3 <= NET_MAXDATA) {
+    uint8_t *d = data(h);
+    memmove(d+3, d+1, len-1);
+    d[2] = len-1;
+    d[1] = d[0];
+    d[0] = AGG_MODULE;
+    aggHandle = h;
+    aggLen = len+2;
+    aggCnt = 1;
+    aggAck = ack;
+    aggStart = millis();
+    return;
+  }
+#endif
 	//uint8_t hdr = RF12_HDR_DST | (ack ? RF12_HDR_ACK : 0) | NET_GW_NODE;
   uint8_t hdr = (ack ? RF12_HDR_ACK : 0) | node_id;
-  rawSend(len, hdr);
+  rawSend(h, len, hdr);
 #endif
 }
 
+#if NET_AGG_MS > 0
+// Send the aggregate packet being built, if any
+void Net::aggFlush(void) {
+  if (!aggHandle) return;
+  net_handle h = aggHandle;
+  uint8_t len = aggLen;
+  aggHandle = 0;
+  if (aggCnt == 1) {
+    // a single record goes out as a normal packet
+    uint8_t *d = data(h);
+    len = d[2]+1;
+    d[0] = d[1];
+    memmove(d+1, d+3, len-1);
+  }
+  rawSend(h, len, (aggAck ? RF12_HDR_ACK : 0) | node_id);
+}
+#endif
+
 // raw form of send where full header gets passed-in, used by GW to forward from ethernet
-void Net::rawSend(uint8_t len, uint8_t hdr) {
+void Net::rawSend(net_handle h, uint8_t len, uint8_t hdr) {
 #ifndef NET_NONE
-  if (bufCnt >= NET_PKT) return; // error?
-  buf[bufCnt].len = len;
-  buf[bufCnt].hdr = hdr;
-  bufCnt++;
-  // if there was no packet queued just go ahead and send the new one
-  if (bufCnt == 1 && rf12_canSend()) {
-    doSend();
+  if (h == 0 || h > NET_PKT || buf[h-1].state != NET_ALLOC) return; // error?
+  if (len > NET_MAXDATA) len = NET_MAXDATA;
+#if NET_RELAY > 0
+  // packets to the management server go to the parent, packets to a node that is reached
+  // through a relay go to that relay
+  uint8_t next = 0;
+  if (!(hdr & (RF12_HDR_DST|RF12_HDR_CTL))) {
+    if (node_id != NET_GW_NODE) next = chooseParent(false);
+    if (next == NET_GW_NODE) next = 0;
+  } else if (hdr & RF12_HDR_DST) {
+    net_route *r = findRoute(hdr & RF12_HDR_MASK);
+    if (r && r->via != r->id) next = r->via;
+  }
+  if (next) {
+    wrap(data(h), len, hdr);
+    len += NET_RELAY_HDR;
+    hdr = hopHdr(next, hdr & RF12_HDR_ACK);
   }
+#endif
+  queue(h, len, hdr);
+  // if the window allows just go ahead and send the new one
+  int8_t i = nextToSend();
+  if (i >= 0 && clearToSend()) doSend(i);
 #endif
 }
 
-
+// Queue a packet for transmission to the next hop given by hdr
+void Net::queue(net_handle h, uint8_t len, uint8_t hdr) {
+  net_packet *p = &buf[h-1];
+  p->hdr = hdr;
+  p->order = txSeq;
+#if NET_WINDOW > 0
+  // packets that get ACKed are numbered per destination so the receiver sees a contiguous
+  // sequence and can detect retransmissions
+  p->seq = hdr & RF12_HDR_ACK ? getPeer(destOf(hdr))->txSeq++ : txSeq;
+#endif
+  txSeq++;
+  p->sendCnt = 0;
+#if NET_WINDOW > 0
+  p->data[len++] = p->seq;
+  p->data[len++] = NET_TRL_MAGIC;
+#endif
+  p->len = len;
+  p->state = NET_READY;
+}
 
 // Broadcast a new packet, this is what user code should call
-void Net::bcast(uint8_t len) {
+void Net::bcast(net_handle h, uint8_t len) {
 #ifndef NET_NONE
-  if (bufCnt >= NET_PKT) return; // error?
-  buf[bufCnt].len = len;
-  buf[bufCnt].hdr = node_id;
-  bufCnt++;
-  // if there was no packet queued just go ahead and send the new one
-  if (bufCnt == 1 && rf12_canSend()) {
-    doSend();
-  }
+  rawSend(h, len, node_id);
+#endif
+}
+
+uint16_t Net::airtime(uint8_t len) {
+#if defined(NET_NONE)
+  return 0;
+#elif defined(NET_SERIAL)
+  // delimiters, COBS code byte, group, header, length, CRC; 10 bits per byte
+  return (uint32_t)(len + 8) * 10000000 / NET_SER_BAUD;
+#else
+  // preamble, sync, header, length, CRC, tail
+  return (uint32_t)(len + 10) * 8000000 / RF12BPS;
 #endif
 }
 
@@ -157,60 +590,392 @@ void Net::getRssi(void) {
 # endif
 }
 
-// Queue an ACK packet
-void Net::queueAck(byte dest_node) {
+#if NET_WINDOW > 0
+// Check whether a packet has been received before and record its sequence number.
+// Sequence numbers more than 8 behind the newest one can't be told apart from a node that
+// restarted its numbering, so they're treated as new.
+bool Net::isDup(uint8_t src, uint8_t seq) {
+  net_peer *pr = getPeer(src);
+  uint8_t d = pr->rxSeq - seq;
+  if (pr->rxValid) {
+    if (d == 0) return true;
+    if (d <= 8) {
+      // older packet
+      if (pr->rxBits & (1 << (d-1))) return true;
+      pr->rxBits |= 1 << (d-1);
+      return false;
+    }
+    d = seq - pr->rxSeq;
+    if (d <= 8) {
+      // newer packet, it becomes the base of the bitmap
+      pr->rxBits = (pr->rxBits << d) | (1 << (d-1));
+      pr->rxSeq = seq;
+      return false;
+    }
+  }
+  pr->rxValid = true;
+  pr->rxSeq = seq;
+  pr->rxBits = 0;
+  return false;
+}
+#endif
+
+// Queue an ACK packet, coalescing it with an ACK already queued for the same node
+// @to is the node that sent the packet if it came to us through a relay, the ACK names it
+void Net::queueAck(byte dest_node, uint8_t seq, uint8_t to) {
   // ACK packets have CTL=1, ACK=0; and
   // either DST=1 and the dest of the ack, or DST=0 and this node as source
-  int8_t hdr = RF12_HDR_CTL;
+  uint8_t hdr = RF12_HDR_CTL;
   hdr |= dest_node == node_id ? node_id : (RF12_HDR_DST|dest_node);
-  queuedAck = hdr; // queue the ACK
-  queuedRssi = lastRcvRssi;
+  for (uint8_t a=0; a<ackCnt; a++) {
+    net_ack *ak = &acks[a];
+    if (ak->hdr != hdr) continue;
+#if NET_RELAY > 0
+    if (ak->to != to) continue;
+#endif
+#if NET_WINDOW > 0
+    uint8_t d = ak->seq - seq;
+    if (d == 0) return;
+    if (d <= 8) {
+      // older packet: add it to the bitmap
+      ak->bits |= 1 << (d-1);
+      return;
+    }
+    d = seq - ak->seq;
+    if (d > 8) continue; // too far apart, needs a separate ACK
+    // newer packet: it becomes the base of the bitmap
+    ak->bits = (ak->bits << d) | (1 << (d-1));
+    ak->seq = seq;
+#endif
+    ak->rssi = lastRcvRssi;
+    return;
+  }
+  if (ackCnt == NET_ACKQ) return; // no room, the sender will have to retransmit
+  net_ack *ak = &acks[ackCnt++];
+  ak->hdr = hdr;
+  ak->rssi = lastRcvRssi;
+  ak->seq = seq;
+  ak->bits = 0;
+#if NET_RELAY > 0
+  ak->to = to;
+#endif
+}
+
+// Remove an ACK from the queue
+void Net::popAck(uint8_t i) {
+  ackCnt--;
+  if (i < ackCnt)
+    memmove(&acks[i], &acks[i+1], sizeof(net_ack)*(ackCnt-i));
+}
+
+// Process an ACK, either received as ACK packet or piggybacked on a data packet, and
+// release all the queued packets it covers
+// @hdr is the header of the ACK (or equivalent ACK packet for piggybacked ACKs)
+// @to is the node the ACK is for if it's sent by a relay, 0 for the gateway
+void Net::ackReceived(uint8_t hdr, uint8_t rssi, uint8_t seq, uint8_t bits, uint8_t to) {
+  net_peer *adapt = 0;
+  // releasing a packet can move the head of the ring, so walk the slots that were in use
+  uint8_t cnt = bufCnt;
+  for (uint8_t n=0, i=bufHead; n<cnt; n++, i=next(i)) {
+    uint8_t h = buf[i].hdr;
+    if (buf[i].state != NET_READY || buf[i].sendCnt == 0 || !(h & RF12_HDR_ACK)) continue;
+    if (h & RF12_HDR_DST) {
+      // we sent to a specific node, it ACKs with itself as source
+      if ((hdr & (RF12_HDR_DST|RF12_HDR_MASK)) != (h & RF12_HDR_MASK)) continue;
+#if NET_RELAY > 0
+      // several nodes may be sending to a relay, its ACKs say which one they're for
+      if (to != (node_id == NET_GW_NODE ? 0 : node_id)) continue;
+#endif
+    } else {
+      // we sent as source, the ACK is directed at us
+      if ((hdr & (RF12_HDR_DST|RF12_HDR_MASK)) != (RF12_HDR_DST|node_id)) continue;
+    }
+#if NET_WINDOW > 0
+    // the ACK must cover the sequence number of the packet
+    uint8_t d = seq - buf[i].seq;
+    if (d > 8 || (d > 0 && !(bits & (1 << (d-1))))) continue;
+#endif
+    lastAckRssi = rssi;
+    net_peer *pr = getPeer(destOf(h));
+    // only measure the RTT if the packet was sent once (Karn's algorithm)
+    if (buf[i].sendCnt == 1) {
+      rttSample(pr, millis() - buf[i].sendTime);
+      adapt = pr;
+    }
+    pr->retryMax = NET_RETRY_MAX;
+    pr->fails = 0;
+#if NET_WINDOW > 0
+    pr->txReset = false; // the destination has seen our numbering
+#endif
+    release(i);
+#if NET_WINDOW == 0
+    break; // stop-and-wait: the ACK is for the first packet in flight
+#endif
+  }
+  // the RSSI is only meaningful if the packet was sent once, i.e. with the power it was sent
+  if (adapt) adaptPower(adapt, rssi);
+}
+
+// Set the transmit power for a packet to dest, full power if dest is 0
+void Net::setPower(uint8_t dest) {
+#if NET_ADAPT > 0 && defined(NET_RF12B)
+  net_peer *pr = dest ? findPeer(dest) : 0;
+  uint8_t power = pr ? pr->power : 0;
+  if (lowPower || power == txPower) return;
+  rf12_control(RF12DEV | power);
+  txPower = power;
+#endif
+}
+
+// Adjust the transmit power to a destination given the RSSI it reported in an ACK
+void Net::adaptPower(net_peer *pr, uint8_t rssi) {
+#if NET_ADAPT > 0
+  if (rssi < NET_RSSI_TARGET) {
+    if (pr->power > 0) pr->power--;
+    pr->strong = 0;
+  } else if (rssi >= NET_RSSI_TARGET + 2*NET_RSSI_STEP && pr->power < NET_POWER_MAX) {
+    // one step less would still leave a margin of one step
+    if (++pr->strong >= NET_ADAPT) {
+      pr->power++;
+      pr->strong = 0;
+    }
+  } else {
+    pr->strong = 0;
+  }
+#endif
 }
 
 // send a node announcement packet -- using during initialization
 void Net::announce(void) {
-#ifdef NET_RF12B
-  if (rf12_canSend()) {
-    struct { uint8_t module; uint16_t uuid; } pkt = { NET_MODULE, nodeUuid };
-    rf12_sendStart(node_id, &pkt, sizeof(pkt));
+#ifndef NET_NONE
+  if (clearToSend()) {
+    // format: module(8), uuid(16), built byte by byte so there's no padding on any platform
+    uint8_t pkt[NET_RELAY_HDR+3+NET_TRAILER];
+    uint8_t *a = pkt+NET_RELAY_HDR;
+    uint8_t hdr = node_id;
+#if NET_RELAY > 0
+    // a new node doesn't know whether it gets through to the gateway, it tries both ways
+    uint8_t next = chooseParent(node_id == NET_UNINIT_NODE && (announceCnt++ & 1));
+    if (next != NET_GW_NODE) {
+      a = pkt;
+      a[0] = RELAY_MODULE;
+      a[1] = node_id;
+      a[2] = node_id;
+      hdr = hopHdr(next, 0);
+    }
+#endif
+    pkt[NET_RELAY_HDR] = NET_MODULE;
+    memcpy(pkt+NET_RELAY_HDR+1, &nodeUuid, sizeof(nodeUuid));
+#if NET_WINDOW > 0
+    // the sequence number is the one the next packet to the gateway will have
+#if NET_RELAY > 0
+    pkt[NET_RELAY_HDR+3] = getPeer(next)->txSeq;
+#else
+    pkt[NET_RELAY_HDR+3] = getPeer(NET_GW_NODE)->txSeq;
+#endif
+    pkt[NET_RELAY_HDR+4] = NET_TRL_MAGIC;
+#endif
+#if NET_SLEEPY > 0
+    if (sleepy) pkt[NET_RELAY_HDR+4] |= NET_TRL_SLEEPY;
+    rxUntil = millis() + NET_RXWIN_MS;
+#endif
+    setPower(0);
+    rf12_sendStart(hdr, a, pkt+sizeof(pkt)-a);
     // send next announcement in 500ms or 20s depending on what we got from EEPROM
     initAt = millis() + (node_id == NET_UNINIT_NODE ? 500 : 20*1000);
     if (initAt == 0) initAt = 1;
     Serial.println(F("Net: sending announcement"));
   }
-#elifdef NET_SERIAL
 #endif
 }
 
-// Poll the rf12 network and return true if a packet has been received
+// Poll the network and return true if a packet has been received
 // ACKs are processed automatically (and are expected not to have data,
 // but do include the RSSI to make for simple round-trip measurements)
 uint8_t Net::poll(void) {
 #ifndef NET_NONE
   bool rcv = rf12_recvDone();
   if (rcv && rf12_crc == 0) {
+    lastRcvLen = rf12_len;
+#if NET_SLEEPY > 0
+    // keep listening while the gateway has something for us
+    if (rf12_hdr & RF12_HDR_DST) rxUntil = millis() + NET_RXWIN_MS;
+#endif
     //Serial.print("Got packet with HDR=0x");
     //Serial.println(rf12_hdr, HEX);
     // at this point either it's a broadcast or it's directed at this node
     if (!(rf12_hdr & RF12_HDR_CTL)) {
+      getRssi();
+      // only the gateway ACKs packets sent with the source's id (i.e. not to a specific node)
+      bool ack = (rf12_hdr & RF12_HDR_ACK) &&
+                 (node_id == NET_GW_NODE || (rf12_hdr & RF12_HDR_DST));
+#if NET_WINDOW > 0
+      // Strip the trailer so the payload looks the same to everyone downstream,
+      // packets without a valid trailer come from a node using a different mode
+      if (rf12_len < NET_TRAILER) {
+        reXmit();
+        return 0;
+      }
+      uint8_t magic = rf12_data[rf12_len-1];
+      bool reset = magic & NET_TRL_RESET;
+      magic &= ~NET_TRL_RESET;
+#if NET_SLEEPY > 0
+      bool sleeper = magic & NET_TRL_SLEEPY;
+      magic &= ~NET_TRL_SLEEPY;
+#endif
+      uint8_t seq = rf12_data[rf12_len-2];
+      if (magic == NET_TRL_ACK && rf12_len >= NET_TRAILER+NET_PIGGY) {
+        // process the piggybacked ACK as if it had come in a separate ACK packet
+        volatile uint8_t *t = rf12_data + rf12_len - NET_TRAILER - NET_PIGGY;
+        ackReceived(RF12_HDR_CTL | (rf12_hdr & (RF12_HDR_DST|RF12_HDR_MASK)), t[0], t[1], t[2]);
+        rf12_len -= NET_PIGGY;
+      } else if (magic != NET_TRL_MAGIC) {
+        reXmit();
+        return 0;
+      }
+      rf12_len -= NET_TRAILER;
+      // packets addressed to us come from the gateway, others carry the source
+      uint8_t src = rf12_hdr & RF12_HDR_DST ? NET_GW_NODE : rf12_hdr & RF12_HDR_MASK;
+      bool announcement = !(rf12_hdr & RF12_HDR_DST) && rf12_len == 3 &&
+                          rf12_data[0] == NET_MODULE;
+      uint8_t to = 0;
+#if NET_RELAY > 0
+      // relayed packets carry the node that sent this hop, and are either for us or need to
+      // be passed on toward their destination
+      bool relayed = rf12_len >= NET_RELAY_HDR && rf12_data[0] == RELAY_MODULE;
+      bool beacon = !relayed && !(rf12_hdr & RF12_HDR_DST) && rf12_len >= 3 &&
+                    rf12_data[0] == NET_MODULE && rf12_data[1] == NET_CMD_BEACON;
+      net_handle fwd = 0;
+      if (relayed) {
+        uint8_t inner = rf12_data[1];
+        src = rf12_data[2] & RF12_HDR_MASK;
+        heard(src);
+        // hops to the gateway are broadcast, the other nodes just overhear them
+        if (!(rf12_hdr & RF12_HDR_DST) && node_id != NET_GW_NODE) {
+          reXmit();
+          return 0;
+        }
+        if (rf12_hdr & RF12_HDR_DST && src != NET_GW_NODE) to = src;
+        // the first hop of a relayed announcement is from the node itself
+        announcement = !(inner & RF12_HDR_DST) && rf12_len == NET_RELAY_HDR+3 &&
+                       rf12_data[3] == NET_MODULE && rf12_data[2] == inner;
+        bool mine = inner & RF12_HDR_DST ? (inner & RF12_HDR_MASK) == node_id
+                                         : node_id == NET_GW_NODE;
+        if (!mine) {
+          // only ACK what we have a buffer for, else the sender retries or goes elsewhere
+          if (relay && (rf12_data[2] >> 5) < NET_HOPS_MAX) fwd = alloc(NET_PRIO_TELEM);
+          if (!fwd) {
+            reXmit();
+            return 0;
+          }
+        }
+      }
+#endif
+#if NET_SLEEPY > 0
+      // a sleepy node listens for a moment now, see asleep()
+      if ((rf12_hdr & RF12_HDR_DST) || node_id == NET_GW_NODE) {
+        net_peer *pr = sleeper ? getPeer(src) : findPeer(src);
+        if (pr) {
+          pr->sleepy = sleeper;
+          pr->heardAt = millis();
+        }
+      }
+#endif
+      // nodes announce themselves periodically, an announcement whose sequence number doesn't
+      // follow the ones received so far means the node restarted and its numbering with it
+      if (announcement) {
+        net_peer *pr = getPeer(src);
+        if ((uint8_t)(seq - pr->rxSeq - 1) >= 16) pr->rxValid = false;
+      }
+      // the first packet flagged with NET_TRL_RESET since the last unflagged one means the
+      // source, e.g. a gateway that rebooted, numbers its packets afresh
+      if (ack) {
+        net_peer *pr = getPeer(src);
+        if (reset && !pr->rxReset) pr->rxValid = false;
+        pr->rxReset = reset;
+      }
+      // check the packets we ACK, only those are retransmitted to us
+      bool dup = ack && isDup(src, seq);
+#else
+      uint8_t seq = 0, to = 0;
+      bool dup = false;
+#endif
+#if NET_RELAY > 0
+      // learn the way to the gateway from beacons and the way back to a node from the
+      // packets relayed for it
+      if (beacon) {
+        net_route *r = getRoute(src);
+        r->via = src;
+        r->hops = rf12_data[2];
+      } else if (relayed && !(rf12_data[1] & RF12_HDR_DST)) {
+        net_route *r = getRoute(rf12_data[1] & RF12_HDR_MASK);
+        r->via = src;
+        r->heardAt = millis();
+      }
+      if (!relayed) heard(src);
+#endif
       // Normal packet (CTL=0), queue an ACK if that's requested
       // (can't immediately send 'cause we need the buffer)
-      getRssi();
-      if (rf12_hdr & RF12_HDR_ACK) queueAck(rf12_hdr & RF12_HDR_MASK);
+      if (ack)
+        queueAck(rf12_hdr & RF12_HDR_MASK, seq, to);
+      // a retransmission of a packet we already got: ACK it again but don't deliver it
+      if (dup) {
+#if NET_RELAY > 0
+        if (fwd) cancel(fwd); // nor pass it on again
+#endif
+        stats.dups++;
+        reXmit();
+        return 0;
+      }
+#if NET_RELAY > 0
+      if (fwd) {
+        forward(fwd);
+        reXmit();
+        return 0;
+      }
+      if (relayed) {
+        // the packet has arrived, what's left looks as if it had been received directly
+        rf12_hdr = rf12_data[1];
+        rf12_len -= NET_RELAY_HDR;
+        for (uint8_t i=0; i<rf12_len; i++) rf12_data[i] = rf12_data[i+NET_RELAY_HDR];
+      }
+#else
+      bool beacon = false;
+#endif
+#if NET_RBCAST > 0
+      if (!(rf12_hdr & RF12_HDR_DST) && rf12_len >= NET_RB_HDR && rf12_data[0] == RBCAST_MODULE &&
+          !rbReceived()) {
+        reXmit();
+        return 0;
+      }
+#endif
+      // the management packets of other nodes are meant for the management server, and
+      // beacons only for Net
+      if (!(rf12_hdr & RF12_HDR_DST) && rf12_data[0] == NET_MODULE &&
+          (node_id != NET_GW_NODE || beacon)) {
+        reXmit();
+        return 0;
+      }
       return rf12_data[0];
     } else if (!(rf12_hdr & RF12_HDR_ACK)) {
       // Ack packet, check that it's for us and that we're waiting for an ACK
       //Serial.print("Got ACK for "); Serial.println(rf12_hdr, 16);
       getRssi();
-      if ((rf12_hdr&RF12_HDR_MASK) == node_id && bufCnt > 0 && sendCnt > 0) {
-        lastAckRssi = rf12_len == 1 ? rf12_data[0] : 0;
-        // pop packet from queue
-        if (bufCnt > 1) {
-          memcpy(buf, &buf[1], sizeof(net_packet)*(NET_PKT-1));
-        }
-        bufCnt--;
-        sendCnt=0;
-      }
+#if NET_RELAY > 0
+      heard(rf12_hdr & RF12_HDR_DST ? NET_GW_NODE : rf12_hdr & RF12_HDR_MASK);
+#endif
+#if NET_SLEEPY > 0
+      net_peer *pr = findPeer(rf12_hdr & RF12_HDR_DST ? NET_GW_NODE : rf12_hdr & RF12_HDR_MASK);
+      if (pr) pr->heardAt = millis();
+#endif
+#if NET_WINDOW > 0
+      // the ACK must name at least the sequence number of the packet
+      if (rf12_len >= 2)
+        ackReceived(rf12_hdr, rf12_data[0], rf12_data[1], rf12_len >= 3 ? rf12_data[2] : 0,
+            rf12_len >= 4 ? rf12_data[3] : 0);
+#else
+      ackReceived(rf12_hdr, rf12_len >= 1 ? rf12_data[0] : 0, 0, 0);
+#endif
     }
   } else if (rcv && rf12_crc != 0) {
     //Serial.println("Got packet with bad CRC");
@@ -223,39 +988,465 @@ uint8_t Net::poll(void) {
 
 void Net::reXmit(void) {
 #ifndef NET_NONE
+#if NET_AGG_MS > 0
+  // send the aggregate packet once its hold-down time is up
+  if (aggHandle && millis() - aggStart >= NET_AGG_MS) aggFlush();
+#endif
+#if NET_RBCAST > 0
+  rbControl();
+#endif
+
   // If we need to resend the announcement, try to send it
   if (initAt != 0 && millis() >= initAt && node_id != NET_GW_NODE) {
     announce();
 
   // If we have a queued ack, try to send it
-  } else if (queuedAck && rf12_canSend()) {
-    rf12_sendStart(queuedAck, &queuedRssi, sizeof(queuedRssi));
-    queuedAck = 0;
-    queuedRssi = 0;
-
-  // We have a freshly queued message (never sent), try to send it
-  } else if (bufCnt > 0 && sendCnt == 0) {
-    if (rf12_canSend()) doSend();
-
-  // We have a queued message  that hasn't been acked and it's time to retry
-  } else if (bufCnt > 0 && sendCnt > 0 && millis() >= sendTime+NET_RETRY_MS) {
-    if (rf12_canSend()) {
-      //Serial.print("Rexmit to 0x");
-      //Serial.print(buf[0].hdr, 16);
+  } else if (ackCnt > 0 && rf12_canSend()) {
+    setPower(destOf(acks[0].hdr));
+#if NET_WINDOW > 0
+    // the ACK carries the RSSI and the sequence numbers of the packets being ACKed
+#if NET_RELAY > 0
+    rf12_sendStart(acks[0].hdr, &acks[0].rssi, acks[0].to ? 4 : acks[0].bits ? 3 : 2);
+#else
+    rf12_sendStart(acks[0].hdr, &acks[0].rssi, acks[0].bits ? 3 : 2);
+#endif
+#else
+    rf12_sendStart(acks[0].hdr, &acks[0].rssi, sizeof(acks[0].rssi));
+#endif
+    popAck(0);
+#if NET_SLEEPY > 0
+    rxUntil = millis() + NET_RXWIN_MS;
+#endif
+
+#if NET_RELAY > 0
+  // Relays tell the nodes around them how far they are from the gateway
+  } else if (relay && node_enabled && node_id != NET_UNINIT_NODE && beaconDue() &&
+             clearToSend()) {
+    beacon();
+#endif
+
+  // We have a fresh message and room in the window, or a message that hasn't been acked
+  // and it's time to retry
+  } else if (bufCnt > 0) {
+    int8_t i = nextToSend();
+    if (i >= 0 && clearToSend()) {
+      //Serial.print("Send to 0x");
+      //Serial.print(buf[i].hdr, 16);
       //Serial.print(" 0x");
-      //Serial.print(buf[0].data[0], 16);
-      //Serial.println((char *)(buf[0].data+1));
-      doSend();
+      //Serial.print(buf[i].data[0], 16);
+      //Serial.println((char *)(buf[i].data+1));
+      doSend(i);
     }
+  }
+#endif
+}
 
+#if NET_RELAY > 0
+// ===== Relaying =====
+
+// Find the route entry for a node
+// @return the entry or null if the node isn't known
+net_route *Net::findRoute(uint8_t id) {
+  for (uint8_t i=0; i<NET_RELAY; i++)
+    if (routes[i].id == id) return &routes[i];
+  return 0;
+}
+
+// Find the route entry for a node, replacing the one heard from longest ago if it's not known
+net_route *Net::getRoute(uint8_t id) {
+  net_route *r = findRoute(id);
+  if (r) return r;
+  r = &routes[0];
+  for (uint8_t i=0; i<NET_RELAY; i++) {
+    if (routes[i].id == 0) { r = &routes[i]; break; }
+    if ((int32_t)(routes[i].heardAt - r->heardAt) < 0) r = &routes[i];
+  }
+  r->id = id;
+  r->via = id;
+  r->hops = id == NET_GW_NODE ? 0 : 0xFF;
+  r->rssi = lastRcvRssi;
+  r->heardAt = millis();
+  return r;
+}
+
+// Record that a packet was received directly from a node: it's its own next hop
+void Net::heard(uint8_t src) {
+  net_route *r = src == NET_GW_NODE && node_id != NET_GW_NODE ? getRoute(src) : findRoute(src);
+  if (!r) return;
+  if (r->via == src) r->rssi = (3*(uint16_t)r->rssi + lastRcvRssi) >> 2;
+  else r->rssi = lastRcvRssi;
+  r->via = src;
+  r->heardAt = millis();
+}
+
+// Choose the next hop toward the gateway and set parent and hops accordingly: the gateway
+// if we hear it and it's getting our packets, else the relay closest to the gateway, with
+// the best RSSI among those that are equally close, and the gateway if all else fails
+// @viaRelay forces the choice of a relay if there is one
+uint8_t Net::chooseParent(bool viaRelay) {
+  net_route *gw = findRoute(NET_GW_NODE);
+  net_route *best = 0;
+  if (!viaRelay && gw && millis() - gw->heardAt <= NET_ROUTE_MS && !heldOff(NET_GW_NODE) &&
+      gw->rssi >= NET_RSSI_MIN) {
+    parent = NET_GW_NODE;
+    hops = 1;
+    return parent;
+  }
+  for (uint8_t i=0; i<NET_RELAY; i++) {
+    net_route *r = &routes[i];
+    if (r->id == 0 || r->id != r->via || r->hops == 0xFF || r->id == NET_GW_NODE) continue;
+    if (millis() - r->heardAt > NET_ROUTE_MS || heldOff(r->id) || r->rssi < NET_RSSI_MIN)
+      continue;
+    if (!best || r->hops < best->hops || (r->hops == best->hops && r->rssi > best->rssi))
+      best = r;
   }
+  if (best) {
+    parent = best->id;
+    hops = best->hops + 1;
+  } else {
+    parent = NET_GW_NODE;
+    hops = 1;
+  }
+  return parent;
+}
+
+// Header of a packet sent to the next hop: packets to the gateway carry our id as source
+uint8_t Net::hopHdr(uint8_t next, uint8_t ack) {
+  return next == NET_GW_NODE ? ack | node_id : RF12_HDR_DST | ack | next;
+}
+
+// Prepend the relay header to a packet
+// @hdr is the header the packet would have had if sent directly
+void Net::wrap(uint8_t *data, uint8_t len, uint8_t hdr) {
+  memmove(data+NET_RELAY_HDR, data, len);
+  data[0] = RELAY_MODULE;
+  data[1] = hdr;
+  data[2] = node_id;
+}
+
+// Send a packet headed for the gateway via a different next hop after it ran out of
+// retries, it gets a fresh retry budget
+// @return true if the packet has been requeued
+bool Net::reroute(net_packet *p) {
+  if (node_id == NET_GW_NODE) return false;
+  bool wrapped = p->data[0] == RELAY_MODULE && p->len >= NET_RELAY_HDR+NET_TRAILER;
+  uint8_t hdr = wrapped ? p->data[1] : p->hdr;
+  if (hdr & (RF12_HDR_DST|RF12_HDR_CTL)) return false;
+  uint8_t par = chooseParent(false);
+  if (par == destOf(p->hdr) || heldOff(par)) return false;
+  if (!wrapped) {
+    wrap(p->data, p->len, p->hdr);
+    p->len += NET_RELAY_HDR;
+  }
+  p->hdr = hopHdr(par, RF12_HDR_ACK);
+  // the packet becomes part of the sequence to the new next hop
+  p->seq = getPeer(par)->txSeq++;
+  p->data[p->len-2] = p->seq;
+  p->sendCnt = 0;
+  return true;
+}
+
+// Pass the received packet on toward its destination, the relay header has the number of
+// relays it went through (incremented here) and the node that sent this hop (us from now on)
+void Net::forward(net_handle h) {
+  uint8_t *d = data(h);
+  uint8_t len = rf12_len;
+  memcpy(d, (uint8_t *)rf12_data, len);
+  uint8_t prev = d[2] & RF12_HDR_MASK;
+  d[2] = ((d[2] & ~RF12_HDR_MASK) + (1 << 5)) | node_id;
+  uint8_t next;
+  if (d[1] & RF12_HDR_DST) {
+    net_route *r = findRoute(d[1] & RF12_HDR_MASK);
+    next = r ? r->via : d[1] & RF12_HDR_MASK;
+  } else {
+    next = chooseParent(false);
+  }
+  // don't bounce it right back, that node will find another way
+  if (next == prev) {
+    cancel(h);
+    return;
+  }
+  // queue it so the ACK for the previous hop goes out first
+  queue(h, len, hopHdr(next, RF12_HDR_ACK));
+}
+
+// Whether it's time for a beacon, which is skipped while there's no way to the gateway. This
+// is checked before clearToSend() since that takes the radio out of receive mode.
+bool Net::beaconDue(void) {
+  if (millis() - beaconAt < NET_BEACON_MS) return false;
+  chooseParent(false);
+  if (hops < NET_HOPS_MAX && !heldOff(parent)) return true;
+  beaconAt = millis();
+  return false;
+}
+
+// Broadcast a beacon with the number of transmissions it takes from here to the gateway
+// Format: module(8), cmd(8), hops(8)
+void Net::beacon(void) {
+  beaconAt = millis();
+  uint8_t pkt[3+NET_TRAILER];
+  pkt[0] = NET_MODULE;
+  pkt[1] = NET_CMD_BEACON;
+  pkt[2] = hops;
+  pkt[3] = txSeq;
+  pkt[4] = NET_TRL_MAGIC;
+  setPower(0);
+  rf12_sendStart(node_id, pkt, sizeof(pkt));
+}
+
+uint8_t Net::routeInfo(uint8_t *pkt, uint8_t max) {
+  uint8_t len = 0;
+  pkt[len++] = NET_MODULE;
+  pkt[len++] = NET_CMD_ROUTES;
+  pkt[len++] = parent;
+  pkt[len++] = hops;
+  for (uint8_t i=0; i<NET_RELAY && len+5 <= max; i++) {
+    net_route *r = &routes[i];
+    if (r->id == 0) continue;
+    uint32_t age = (millis() - r->heardAt) / 1000;
+    pkt[len++] = r->id;
+    pkt[len++] = r->via;
+    pkt[len++] = r->hops;
+    pkt[len++] = r->rssi;
+    pkt[len++] = age > 255 ? 255 : age;
+  }
+  return len;
+}
+
+// Send the next hop and the route entries to the management server
+void Net::sendRoutes(void) {
+  net_handle h = alloc(NET_PRIO_CTL);
+  if (!h) return;
+  send(h, routeInfo(data(h), NET_MAXDATA));
+}
 #endif
+
+#if NET_RBCAST > 0
+// ===== Reliable broadcast =====
+
+void Net::rbcast(net_handle h, uint8_t len) {
+#ifndef NET_NONE
+  if (h == 0 || h > NET_PKT || buf[h-1].state != NET_ALLOC) return;
+  if (len > NET_MAXDATA-NET_RB_HDR) len = NET_MAXDATA-NET_RB_HDR;
+  uint8_t *d = data(h);
+  memmove(d+NET_RB_HDR, d, len);
+  d[0] = RBCAST_MODULE;
+  d[1] = rbSeq++;
+  len += NET_RB_HDR;
+  // keep a copy for repairs, time packets in it get the time they're resent at
+  net_rbitem *it = &rbItems[rbSlot];
+  if (++rbSlot == NET_RBCAST) rbSlot = 0;
+  it->len = len;
+  it->sentAt = millis();
+  memcpy(it->data, d, len);
+  rbBeats = 0;
+  rbBeatAt = millis() + NET_RB_BEAT_MS;
+  bcast(h, len);
+#endif
+}
+
+// Process a received RBCAST_MODULE packet: the gateway repairs what a NACK asks for, nodes
+// keep track of the broadcasts they got. A broadcast that's delivered has its header removed
+// so it looks like a plain broadcast.
+// @return true if the packet is to be delivered
+bool Net::rbReceived(void) {
+  uint8_t src = rf12_hdr & RF12_HDR_MASK;
+  if (node_id == NET_GW_NODE) {
+    if (rf12_len == 3 && src != NET_GW_NODE) rbRepair(rf12_data[1], rf12_data[2]);
+    return false;
+  }
+  uint8_t s = rf12_data[1];
+  if (src != NET_GW_NODE) {
+    // another node's NACK: the repair is on its way, ask later if it doesn't get here
+    if (rf12_len == 3 && nackAt && s == rbNext)
+      nackAt = millis() + 2*NET_NACK_MS + random(NET_NACK_MS);
+    return false;
+  }
+  bool item = rf12_len > NET_RB_HDR;
+  // a number more than 8 behind the ones we have means the gateway restarted
+  if (!rbValid || ((uint8_t)(rbNext - s) > 8 && (uint8_t)(rbNext - s) < 128)) {
+    rbValid = true;
+    rbNext = rbHigh = s;
+    rbBits = 0;
+  }
+  uint8_t d = s - rbNext;
+  if (d >= 128) {
+    // older than the ones we're missing: a repair someone else asked for
+    if (item) stats.dups++;
+    return false;
+  }
+  // too far ahead to keep track of, give up on what's missing before
+  if (d > 7) {
+    rbShift(s-7);
+    d = s - rbNext;
+  }
+  if (!item) {
+    // heartbeat with the next number
+    if ((uint8_t)(s - rbHigh) < 128) rbHigh = s;
+  } else if (rbBits & (1 << d)) {
+    stats.dups++;
+    return false;
+  } else {
+    rbBits |= 1 << d;
+    if ((uint8_t)(s+1 - rbHigh) < 128) rbHigh = s+1;
+  }
+  uint8_t n = rbNext;
+  rbShift(rbNext);
+  if (rbNext != n) nackCnt = 0;
+  if (rbNext == rbHigh) nackAt = 0;
+  else if (!nackAt) nackAt = millis() + 1 + random(NET_NACK_MS);
+  if (!item) return false;
+  // byte by byte: rf12_buf is volatile, memmove on it gets miscompiled
+  rf12_len -= NET_RB_HDR;
+  for (uint8_t i=0; i<rf12_len; i++) rf12_data[i] = rf12_data[i+NET_RB_HDR];
+  return true;
 }
 
+// Move rbNext forward to the first broadcast not received at or after to, broadcasts
+// skipped on the way are lost
+void Net::rbShift(uint8_t to) {
+  for (; rbNext != to; rbNext++) {
+    if (!(rbBits & 1)) stats.lost++;
+    rbBits >>= 1;
+  }
+  for (; rbBits & 1; rbNext++) rbBits >>= 1;
+  if ((uint8_t)(rbHigh - rbNext) >= 128) rbHigh = rbNext;
+}
+
+// Broadcast again what a node is missing: all the broadcasts from first on that are still
+// kept, except those the bitmap says it has and those that were sent a moment ago (in
+// response to another NACK)
+// @first is the first broadcast missing
+// @bits bit n set: broadcast first+1+n has been received
+void Net::rbRepair(uint8_t first, uint8_t bits) {
+  for (uint8_t i=0; i<NET_RBCAST; i++) {
+    net_rbitem *it = &rbItems[i];
+    uint8_t d = it->data[1] - first;
+    if (it->len == 0 || d >= 128 || (d > 0 && d <= 8 && (bits & (1 << (d-1)))) ||
+        millis() - it->sentAt < NET_NACK_MS)
+      continue;
+    net_handle h = alloc(NET_PRIO_CTL);
+    if (!h) return;
+    memcpy(data(h), it->data, it->len);
+    it->sentAt = millis();
+    stats.repairs++;
+    bcast(h, it->len);
+  }
+}
+
+// Send the heartbeats of the gateway and the NACKs of the nodes when they're due
+void Net::rbControl(void) {
+  if (rbBeats < NET_RB_BEATS && (int32_t)(millis() - rbBeatAt) >= 0) {
+    net_handle h = alloc(NET_PRIO_CTL);
+    if (!h) return;
+    data(h)[0] = RBCAST_MODULE;
+    data(h)[1] = rbSeq;
+    bcast(h, NET_RB_HDR);
+    rbBeatAt = millis() + ((uint32_t)NET_RB_BEAT_MS << ++rbBeats);
+  }
+  if (nackAt && (int32_t)(millis() - nackAt) >= 0 && node_id != NET_GW_NODE) {
+    if (nackCnt >= NET_NACK_MAX) {
+      rbShift(rbHigh);
+      nackAt = 0;
+      return;
+    }
+    net_handle h = alloc(NET_PRIO_CTL);
+    if (!h) return;
+    uint8_t *pkt = data(h);
+    pkt[0] = RBCAST_MODULE;
+    pkt[1] = rbNext;
+    pkt[2] = rbBits >> 1;
+    rawSend(h, 3, node_id);
+    stats.nacks++;
+    nackCnt++;
+    nackAt = millis() + 2*NET_NACK_MS + random(NET_NACK_MS);
+  }
+}
+#endif
+
+#if NET_SLEEPY > 0
+// ===== Sleeping =====
+
+bool Net::idle(void) {
+  // rf12_canSend() would take the radio out of receive mode, so only Net's own state counts
+  if (bufCnt > 0 || ackCnt > 0) return false;
+#if NET_AGG_MS > 0
+  if (aggHandle) return false;
+#endif
+  return (int32_t)(millis() - rxUntil) >= 0;
+}
+
+uint32_t Net::sleep(uint32_t ms) {
+#ifdef NET_RF12B
+  if (!idle()) return 0;
+  // wake up in time for the next announcement
+  if (initAt != 0 && node_id != NET_GW_NODE) {
+    int32_t d = initAt - millis();
+    if (d <= 0) return 0;
+    if ((uint32_t)d < ms) ms = d;
+  }
+  uint32_t t = millis();
+  rf12_sleep(RF12_SLEEP);
+  while (ms > 0) {
+    word n = ms > 60000 ? 60000 : ms;
+    if (!Sleepy::loseSomeTime(n)) break; // woken up by another interrupt
+    ms -= n;
+  }
+  rf12_sleep(RF12_WAKEUP);
+  return millis() - t;
+#else
+  return 0;
+#endif
+}
+#endif
+
 // Constructor
 Net::Net(uint8_t group_id, bool lowPower) {
   this->group_id = group_id;
   this->lowPower = lowPower;
+  memset(buf, 0, sizeof(buf));
+  memset(peers, 0, sizeof(peers));
+  memset(&stats, 0, sizeof(stats));
+  rrDest = 0;
+  bufHead = 0;
+  bufCnt = 0;
+  txSeq = 0;
+  ackCnt = 0;
+#if NET_AGG_MS > 0
+  aggHandle = 0;
+#endif
+#if NET_ADAPT > 0
+  txPower = 0;
+#endif
+#if NET_SLEEPY > 0
+  sleepy = false;
+  rxUntil = 0;
+#endif
+#if NET_TDMA > 0
+  slot = 1;
+  slotPhase = 0;
+  slotSyncAt = 0;
+#endif
+#if NET_CSMA_SLOT > 0
+  backoffExp = NET_BE_MIN;
+  backoffAt = 0;
+#endif
+#if NET_RBCAST > 0
+  memset(rbItems, 0, sizeof(rbItems));
+  rbSlot = 0;
+  rbSeq = 0;
+  rbBeats = NET_RB_BEATS;
+  rbValid = false;
+  nackAt = 0;
+#endif
+#if NET_RELAY > 0
+  memset(routes, 0, sizeof(routes));
+  relay = false;
+  beaconAt = 0;
+  announceCnt = 0;
+  parent = NET_GW_NODE;
+  hops = 1;
+#endif
   initAt = millis();
   if (initAt == 0) initAt = 1;
   moduleId = NET_MODULE;
@@ -264,12 +1455,12 @@ Net::Net(uint8_t group_id, bool lowPower) {
 
 // ===== Configuration =====
 
-void Net::receive(volatile uint8_t *pkt, uint8_t len) {
+void Net::receive(volatile uint8_t *pkt, uint16_t len) {
 #ifndef NET_NONE
   //Serial.println("Got initialization packet!");
   // handle initialization packet (response to announcement)
-  // Format: module(8), uuid(16), node_id(8), enabled(8)
-  if (len == 4 && *(uint16_t*)(pkt) == nodeUuid) {
+  // Format: module(8), uuid(16), node_id(8), enabled(8), optional slot(8) (NET_TDMA)
+  if ((len == 4 || len == 5) && *(uint16_t*)(pkt) == nodeUuid) {
     switch (pkt[3]) {
       case 0: node_enabled = false; break;  // force disable (e.g. new node or crc change)
       case 1: node_enabled = true; break;   // force enable
@@ -284,10 +1475,81 @@ void Net::receive(volatile uint8_t *pkt, uint8_t len) {
       net_config eeprom = { node_id, node_enabled, nodeUuid };
       config_write(NET_MODULE, &eeprom);
     }
+#if NET_TDMA > 0
+    if (len == 5 && pkt[4] > 0 && pkt[4] < NET_TDMA) slot = pkt[4];
+#endif
+  } else if (len >= 1 && pkt[0] == NET_CMD_PEERS) {
+    sendPeers();
+  } else if (len >= 1 && pkt[0] == NET_CMD_STATS) {
+    sendStats();
+#if NET_RELAY > 0
+  } else if (len >= 1 && pkt[0] == NET_CMD_ROUTES) {
+    sendRoutes();
+#endif
   }
 #endif
 }
 
+// Commands received through the RPC layer: the counters, link state, and routes are returned
+// in the reply, without the module and command bytes, the init packet is applied as when
+// received directly
+uint8_t Net::call(volatile uint8_t *pkt, uint8_t len, uint8_t *reply, uint8_t *replyLen) {
+  if ((len == 4 || len == 5) && *(uint16_t*)(pkt) == nodeUuid) {
+    receive(pkt, len);
+    return RPC_OK;
+  }
+  uint8_t n = 0;
+  if (len >= 1 && pkt[0] == NET_CMD_STATS) n = statsInfo(reply, RPC_MAXREPLY);
+  else if (len >= 1 && pkt[0] == NET_CMD_PEERS) n = peerInfo(reply, RPC_MAXREPLY);
+#if NET_RELAY > 0
+  else if (len >= 1 && pkt[0] == NET_CMD_ROUTES) n = routeInfo(reply, RPC_MAXREPLY);
+#endif
+  else return RPC_EOP;
+  if (n < 2) return RPC_ESIZE;
+  memmove(reply, reply+2, n-2);
+  *replyLen = n-2;
+  return RPC_OK;
+}
+
+uint8_t Net::statsInfo(uint8_t *pkt, uint8_t max) {
+  if (max < 2+sizeof(stats)) return 0;
+  pkt[0] = NET_MODULE;
+  pkt[1] = NET_CMD_STATS;
+  memcpy(pkt+2, &stats, sizeof(stats));
+  return 2+sizeof(stats);
+}
+
+// Send the diagnostic counters to the management server
+void Net::sendStats(void) {
+  net_handle h = alloc(NET_PRIO_CTL);
+  if (!h) return;
+  send(h, statsInfo(data(h), NET_MAXDATA));
+}
+
+uint8_t Net::peerInfo(uint8_t *pkt, uint8_t max) {
+  uint8_t len = 0;
+  pkt[len++] = NET_MODULE;
+  pkt[len++] = NET_CMD_PEERS;
+  for (uint8_t i=0; i<NET_PEERS && len+9 <= max; i++) {
+    net_peer *pr = &peers[i];
+    if (pr->id == 0) continue;
+    uint16_t v[3] = { (uint16_t)(pr->srtt >> 3), (uint16_t)(pr->rttvar >> 2), rto(pr) };
+    pkt[len++] = pr->id;
+    pkt[len++] = pr->retryMax;
+    pkt[len++] = pr->fails;
+    memcpy(pkt+len, v, sizeof(v));
+    len += sizeof(v);
+  }
+  return len;
+}
+
+// Send the link state of all peers to the management server
+void Net::sendPeers(void) {
+  net_handle h = alloc(NET_PRIO_CTL);
+  if (!h) return;
+  send(h, peerInfo(data(h), NET_MAXDATA));
+}
+
 // ApplyConfig() not just processes the EEPROM config but also initializes the RF12 module
 void Net::applyConfig(uint8_t *cf) {
   net_config *eeprom = (net_config *)cf;
@@ -307,6 +1569,9 @@ void Net::applyConfig(uint8_t *cf) {
   node_id = eeprom->nodeId;
   node_enabled = eeprom->enabled;
   nodeUuid = eeprom->nodeUuid;
+  // start the sequence numbers somewhere else after each reset so receivers don't take our
+  // first packets for duplicates
+  txSeq = micros();
 
   setNodeId(node_id);
   
@@ -316,10 +1581,21 @@ void Net::applyConfig(uint8_t *cf) {
 
 void Net::setNodeId(uint8_t id) {
   node_id = id;
+#if NET_TDMA > 0
+  slot = 1 + node_id % (NET_TDMA-1);
+#endif
 
 #ifdef NET_NONE
 	Serial.println(F("Config Net: RF12B disabled"));
 	return;
+#elif defined(NET_SERIAL)
+  Serial.print(F("Config Net: serial node_id="));
+  Serial.print(node_id);
+  Serial.print(F(" group_id="));
+  Serial.print(group_id);
+  Serial.print(F(" uuid=0x"));
+  Serial.println(nodeUuid, HEX);
+  ser_initialize(node_id, group_id);
 #else
   // initialize rf12 module
   Serial.print(F("Config Net: node_id="));
@@ -329,16 +1605,17 @@ void Net::setNodeId(uint8_t id) {
   Serial.print(F(" uuid=0x"));
   Serial.println(nodeUuid, HEX);
   rf12_initialize(node_id, RF12_915MHZ, group_id);
-  if (lowPower) {
-    Serial.println(F("  low TX power"));
-    rf12_control(0x9857); // reduce tx power
-    rf12_control(0x94B2); // attenuate receiver 0x94B2 or 0x94Ba
-  }
-#ifdef RF12_19K
-  Serial.println(F("  19kbps"));
+  Serial.println(F("  " RF12KBPS "kbps"));
   rf12_control(RF12RATE);
   rf12_control(RF12BW);
   rf12_control(RF12DEV);
+  if (lowPower) {
+    Serial.println(F("  low TX power"));
+    rf12_control(RF12DEV | 0x07); // reduce tx power
+    rf12_control(RF12BW | 0x10);  // attenuate receiver by 14dB (0x18 for 20dB)
+  }
+#if NET_ADAPT > 0
+  txPower = 0;
 #endif
 
 	//Serial.println("  rf12 initialized");
@@ -1,6 +1,6 @@
 // Copyright (c) 2013 Thorsten von Eicken
 //
-// RFG12 network transport layer.
+// RFG12 network transport layer, or a serial link with NET_SERIAL (see NetSerial.h).
 // Supports 5 classes of packets: node announcements, node initialization
 // packets to gateway, packets from gateway, inter-node broadcasts, and ACKs. Manages the
 // announcement of the node at power-up and includes automatic dispatch of received messages.
@@ -12,15 +12,305 @@
 #define NET_GW_NODE      1  // gateway to the IP network
 #define NET_UNINIT_NODE 30  // uninitialized node
 
-// rf12 packet minus the leading group byte
+// Windowed transport: with NET_WINDOW > 0 every packet carries a sequence number in a
+// trailer after the payload and up to NET_WINDOW packets per destination can be awaiting an
+// ACK at the same time, each one being ACKed individually. With NET_WINDOW 0 (the default)
+// the transport is the original stop-and-wait without trailer. All nodes in a group must use
+// the same mode. Destinations are served round-robin, so a destination that doesn't ACK
+// doesn't hold up packets to others. Packets that request an ACK are numbered per destination
+// and the receiver uses the sequence numbers to drop retransmitted packets it has already
+// delivered (they are ACKed again); use NET_WINDOW 1 to get this with stop-and-wait.
+#ifndef NET_WINDOW
+#define NET_WINDOW     0                // max number of packets in flight, 0=stop-and-wait
+#endif
+#ifndef NET_PKT
+#if NET_WINDOW > 1
+#define NET_PKT        (NET_WINDOW+1)   // number of packet buffers allocated
+#else
+#define NET_PKT        2                // number of packet buffers allocated
+#endif
+#endif
+#if NET_WINDOW > NET_PKT
+#error "NET_WINDOW must not be larger than NET_PKT"
+#endif
+#if NET_WINDOW > 8
+#error "NET_WINDOW must not be larger than 8"
+#endif
+
+#if NET_WINDOW > 0
+#define NET_TRAILER    2                // trailer: sequence number, magic
+#define NET_TRL_MAGIC  0xA5             // last byte of every windowed packet
+#define NET_TRL_ACK    0xA6             // last byte if an ACK is piggybacked in the trailer
+#define NET_PIGGY      3                // size of a piggybacked ACK: rssi, seq, bits
+// A sender numbers the packets to a node afresh when it (re)starts or had to replace its
+// entry for the node, it sets NET_TRL_RESET in the magic of those it sends until the node
+// ACKs one, and the node starts a new duplicate window with the first flagged packet
+#define NET_TRL_RESET  0x10             // magic bit: the sender's numbering starts over
+#else
+#define NET_TRAILER    0
+#endif
+
+// Sleepy nodes: with NET_SLEEPY a battery-powered node can call setSleepy(true) and then
+// sleep() whenever it has nothing else to do: it turns off the radio and powers down the MCU
+// using Sleepy. After each packet it sends or receives the node keeps the radio on for
+// NET_RXWIN_MS to get ACKs and packets from the gateway. It marks its packets by setting
+// NET_TRL_SLEEPY in the magic of the trailer and the gateway (or relay) holds the packets
+// for the node until it hears from it, i.e. until its next uplink. Needs NET_WINDOW > 0 and
+// the gateway and the sleepy nodes must be built with it.
+#ifndef NET_SLEEPY
+#define NET_SLEEPY     0                // 1=support for sleepy nodes
+#endif
+#if NET_SLEEPY > 0
+#if NET_WINDOW == 0
+#error "NET_SLEEPY requires NET_WINDOW > 0"
+#endif
+#define NET_TRL_SLEEPY 0x08             // magic bit: the sender sleeps between packets
+#ifndef NET_RXWIN_MS
+#define NET_RXWIN_MS   100              // how long a sleepy node listens after a packet
+#endif
+#endif
+
+// Relaying: with NET_RELAY > 0 a node that doesn't get through to the gateway sends via a
+// relay, i.e. a mains-powered node that has relaying turned on with setRelay(true). Relays
+// broadcast a beacon with their distance to the gateway every NET_BEACON_MS. Each node keeps
+// track of the relays and the gateway it hears, with their RSSI, and sends directly to the
+// gateway while it hears it and the link isn't stalled, else via the relay closest to the
+// gateway with the best RSSI. A relayed packet starts with a header (RELAY_MODULE, original rf12 header, node
+// that sent this hop) and is ACKed hop by hop. The gateway and the relays learn the way back
+// to each node from the packets they relay and the gateway removes the header, so relaying
+// is invisible to the management server. NET_RELAY is the number of route entries kept; the
+// gateway, the relays, and the nodes that are to use relays must all be built with it.
+#ifndef NET_RELAY
+#define NET_RELAY      0                // number of route entries, 0=no relaying
+#endif
+#if NET_RELAY > 0
+#if NET_WINDOW == 0
+#error "NET_RELAY requires NET_WINDOW > 0"
+#endif
+#define NET_RELAY_HDR  3                // header of relayed packets
+#define NET_HOPS_MAX   7                // max number of relays a packet goes through
+#define NET_BEACON_MS  30000            // interval between beacons sent by relays
+#define NET_ROUTE_MS   (3L*NET_BEACON_MS) // relays not heard for that long aren't used
+#ifndef NET_RSSI_MIN
+#define NET_RSSI_MIN   0                // relays and gateway heard weaker aren't used
+#endif
+#else
+#define NET_RELAY_HDR  0
+#endif
+#define NET_MAXDATA    (RF12_MAXDATA-NET_TRAILER-NET_RELAY_HDR) // max payload user code can send
+
+// Packet buffer states
+#define NET_FREE       0                // unused
+#define NET_ALLOC      1                // handed out by alloc(), being filled by the caller
+#define NET_READY      2                // queued for transmission (or awaiting an ACK)
+
+// Packet priorities, packets are sent in strict priority order (ACKs always go first)
+#define NET_PRIO_CTL   0                // control: commands, responses, time
+#define NET_PRIO_TELEM 1                // telemetry: sensor data
+#define NET_PRIO_BULK  2                // bulk: log messages
+
+// rf12 packet minus the leading group byte, plus its transmit state while queued
 typedef struct {
+  uint8_t   state;              // NET_FREE, NET_ALLOC, or NET_READY
+  uint8_t   prio;               // NET_PRIO_*
   uint8_t   hdr;
-  uint8_t   len;
+  uint8_t   len;                // length on the wire, including trailer
   uint8_t   data[RF12_MAXDATA];
+  uint8_t   seq;                // sequence number (only sent with NET_WINDOW > 0)
+  uint8_t   order;              // when the packet was queued relative to the others
+  uint8_t   sendCnt;            // number of transmissions, 0 if not sent yet
+  uint32_t  sendTime;           // when last transmitted (for retries)
+  uint16_t  timeout;            // retransmission timeout for the last transmission
 } net_packet;
-#ifndef NET_PKT
-#define NET_PKT        2                // number of packet buffers allocated
+
+// Handle for an allocated packet buffer, 0 means no buffer
+typedef uint8_t net_handle;
+
+// Retransmission: the timeout (RTO) for each destination is derived from the measured
+// send-to-ACK round-trip time (Jacobson/Karels), doubles with each retry, and has some random
+// jitter added so nodes don't retry in lockstep. The retry budget of a link is halved each
+// time a packet runs out of retries and is restored when a packet gets ACKed.
+#ifndef NET_PEERS
+#define NET_PEERS      4                // number of destinations for which link state is kept
+#endif
+#define NET_RETRY_MS   100              // initial RTO, before any RTT has been measured
+#define NET_RTO_MIN    20               // min RTO in ms
+#define NET_RTO_MAX    2000             // max RTO in ms, including backoff
+#define NET_RETRY_MAX  8                // max number of transmissions of a packet
+#define NET_RETRY_MIN  2                // min retry budget of a failing link
+#define NET_STALL_MS   1000             // hold-off for a destination after a packet failed
+#define NET_STALL_MAX  5                // max doublings of NET_STALL_MS
+
+// Listen before talk: with NET_CSMA_SLOT > 0 each packet (other than an ACK) waits a random
+// number of slots before the channel is checked, the rf12 reports it busy while its RSSI
+// indicator shows a carrier or a packet is being received. If it's busy the packet waits
+// again for up to twice as many slots. This spreads out nodes that would otherwise transmit
+// at the same moment, e.g. after waking up on the same second. ACKs go out right away, which
+// gives them precedence over packets that are backing off.
+#ifndef NET_CSMA_SLOT
+#define NET_CSMA_SLOT  0                // backoff slot in ms, 0=no backoff
+#endif
+#define NET_BE_MIN     2                // initial backoff: up to 2^NET_BE_MIN-1 slots
+#define NET_BE_MAX     5                // max backoff: up to 2^NET_BE_MAX-1 slots
+
+// Slotted schedule (TDMA): with NET_TDMA > 0 time is divided into superframes of NET_TDMA
+// slots of NET_SLOT_MS each, aligned to the time broadcast by the gateway (see NetTime).
+// Slot 0 is the contention slot, the others are assigned to nodes by the hub in the init
+// packet, else a node uses slot 1+node_id%(NET_TDMA-1). Once its clock has been set a node
+// holds back the first transmission of a packet until its own slot comes up and sends
+// retransmissions in the contention slot. Transmissions only start in the first half of a
+// slot, the rest leaves room for the packet, its ACK, and clock error. A node that hasn't
+// heard the time for NET_SYNC_MS contends for the channel as without TDMA, the gateway
+// always does.
+#ifndef NET_TDMA
+#define NET_TDMA       0                // slots per superframe, 0=no slotted schedule
+#endif
+#ifndef NET_SLOT_MS
+#define NET_SLOT_MS    100              // length of a slot in ms
+#endif
+#define NET_SYNC_MS    600000           // time after which the schedule is out of sync
+#if NET_TDMA > 0
+#if NET_TDMA < 2 || NET_TDMA * NET_SLOT_MS > 60000
+#error "NET_TDMA needs 2 or more slots and a superframe of at most 60s"
+#endif
+#define NET_FRAME_MS   ((uint16_t)NET_TDMA * NET_SLOT_MS)
+#endif
+
+// Data rate presets: the rf12 only receives packets sent at the rate it's set to and the
+// gateway listens for all nodes at once, so all the nodes of a network must use the same
+// preset. Slower rates get further at the cost of airtime.
+#ifndef NET_RATE
+#define NET_RATE       1                // 0=49.2kbps, 1=19.2kbps, 2=9.6kbps
+#endif
+
+// Transmit power control: with NET_ADAPT > 0 packets to a destination are sent with as
+// little power as it takes for the destination to receive them with an RSSI of at least
+// NET_RSSI_TARGET, based on the RSSI it reports in its ACKs. The power is reduced one step
+// (about 2.5dB) after NET_ADAPT ACKs in a row report at least NET_RSSI_STEP more than needed
+// for that, and raised one step when an ACK reports less than the target or a packet needs
+// to be retransmitted. Broadcasts, announcements, and packets that run out of retries are
+// sent at full power. This needs the RSSI hardware (see RSSI_PIN in Net.cpp) on all nodes.
+#ifndef NET_ADAPT
+#define NET_ADAPT      0                // number of ACKs before reducing power, 0=full power
+#endif
+#ifndef NET_RSSI_TARGET
+#define NET_RSSI_TARGET 60              // min RSSI (as read by getRssi) the receiver should see
+#endif
+#define NET_RSSI_STEP  10               // RSSI change per power step
+#define NET_POWER_MAX  7                // max power reduction in steps (-17.5dB)
+
+// Link state for a destination
+typedef struct {
+  uint8_t   id;                 // node id of the destination, 0 if the entry is unused
+  uint32_t  usedAt;             // when the entry was last looked up, for replacing it
+  uint8_t   retryMax;           // retry budget: max number of transmissions of a packet
+  uint8_t   fails;              // packets that ran out of retries since the last ACK
+  uint32_t  retryAt;            // when a stalled destination (fails>0) may be tried again
+#if NET_WINDOW > 0
+  uint8_t   txSeq;              // sequence number of the next packet to this node that's ACKed
+  bool      rxValid;            // whether rxSeq/rxBits have been set
+  uint8_t   rxSeq;              // newest sequence number received from this node
+  uint8_t   rxBits;             // bit n set: sequence number rxSeq-1-n has been received
+  bool      txReset;            // flag the packets to this node with NET_TRL_RESET
+  bool      rxReset;            // the last packet from this node had NET_TRL_RESET
+#endif
+  uint16_t  srtt;               // smoothed round-trip time in ms, scaled by 8, 0=no sample
+  uint16_t  rttvar;             // round-trip time variation in ms, scaled by 4
+#if NET_ADAPT > 0
+  uint8_t   power;              // transmit power reduction in steps, 0=full power
+  uint8_t   strong;             // ACKs in a row that reported a strong signal
+#endif
+#if NET_SLEEPY > 0
+  bool      sleepy;             // whether the node sleeps between packets
+  uint32_t  heardAt;            // when a packet from the node was last received
+#endif
+} net_peer;
+
+// Queued ACK, with NET_WINDOW > 0 one ACK can cover several packets from the same node
+#ifndef NET_ACKQ
+#define NET_ACKQ       4                // number of ACKs that can be queued
+#endif
+typedef struct {
+  uint8_t   hdr;                // header of the ACK packet, 0 if the entry is unused
+  uint8_t   rssi;               // RSSI of the packet being ACKed
+  uint8_t   seq;                // sequence number of the newest packet being ACKed
+  uint8_t   bits;               // bit n set: packet seq-1-n is ACKed too
+#if NET_RELAY > 0
+  uint8_t   to;                 // node that sent the packet to us via relay, 0 if none
+#endif
+} net_ack;
+
+#if NET_RELAY > 0
+// Route entry: a relay or the gateway heard by this node (a candidate next hop toward the
+// gateway), or a node reached through a relay
+typedef struct {
+  uint8_t   id;                 // node id, 0 if the entry is unused
+  uint8_t   via;                // next hop to the node, id if it's heard directly
+  uint8_t   hops;               // candidates: transmissions it takes from there to the
+                                // gateway, 0 for the gateway, 0xFF for other nodes
+  uint8_t   rssi;               // smoothed RSSI of the packets heard from via
+  uint32_t  heardAt;            // when via was last heard
+} net_route;
+#endif
+
+// Aggregation: with NET_AGG_MS > 0 small packets passed to send() are held for up to
+// NET_AGG_MS milliseconds and packed together into a single AGG_MODULE packet, which
+// config_dispatch unpacks on the receiving end. NET_MODULE packets are never aggregated.
+#ifndef NET_AGG_MS
+#define NET_AGG_MS     0                // max hold-down time in ms, 0=no aggregation
+#endif
+
+// Reliable broadcast: with NET_RBCAST > 0 the gateway can broadcast packets with rbcast(), each
+// one prefixed with RBCAST_MODULE and a sequence number. A node that sees a gap in the numbers
+// waits a random time of up to NET_NACK_MS and then sends a NACK to the gateway with the first
+// missing number and a bitmap of the ones after it it did get; it holds back its own NACK when
+// it overhears another node asking for the same. The gateway keeps the last NET_RBCAST
+// broadcasts and sends the missing ones again (broadcast, other nodes may need them too). It
+// follows the last broadcast with heartbeats carrying the next number, NET_RB_BEAT_MS later and
+// then at twice and four times that interval, so the loss of the last one is noticed. A node
+// gives up on missing broadcasts after NET_NACK_MAX NACKs or when it falls more than 8 behind.
+// Repaired broadcasts are delivered out of order, each one should stand on its own (a time, a
+// complete setting). Relays don't pass broadcasts on. NET_RBCAST costs about NET_RBCAST*70
+// bytes of RAM in the gateway; the gateway and the nodes must all be built with it.
+#ifndef NET_RBCAST
+#define NET_RBCAST     0                // number of broadcasts kept for repair, 0=no rbcast
+#endif
+#if NET_RBCAST > 8
+#error "NET_RBCAST must not be larger than 8"
 #endif
+#define NET_RB_HDR     2                // header: RBCAST_MODULE, sequence number
+#define NET_NACK_MS    200              // max random delay before a node sends a NACK
+#define NET_NACK_MAX   4                // max number of NACKs for a missing broadcast
+#define NET_RB_BEAT_MS 2000             // time from the last broadcast to the first heartbeat
+#define NET_RB_BEATS   3                // number of heartbeats after the last broadcast
+
+#if NET_RBCAST > 0
+// Broadcast kept by the gateway for repair
+typedef struct {
+  uint8_t   len;                // length including the header, 0 if the entry is unused
+  uint32_t  sentAt;             // when it was last sent
+  uint8_t   data[NET_MAXDATA];  // RBCAST_MODULE, sequence number, payload
+} net_rbitem;
+#endif
+
+// Counters kept by Net for diagnostics
+typedef struct {
+  uint16_t  drops;              // queued packets dropped to make room for new ones
+  uint16_t  dups;               // duplicate packets received (ACKed but not delivered)
+  uint16_t  evicts;             // queued packets evicted by higher priority ones
+  uint16_t  retries;            // retransmissions (the packet or its ACK was lost or collided)
+  uint16_t  busy;               // backoffs that ended with the channel busy (NET_CSMA_SLOT)
+  uint16_t  nacks;              // NACKs sent for missing broadcasts (NET_RBCAST)
+  uint16_t  repairs;            // broadcasts sent again in response to NACKs
+  uint16_t  lost;               // broadcasts given up on
+} net_stats;
+
+// Commands to the NET_MODULE (the initialization packet is also sent to the NET_MODULE but
+// has a length of 4 and starts with the uuid of the node)
+#define NET_CMD_PEERS  0x10             // reply with the link state of all peers
+#define NET_CMD_STATS  0x11             // reply with the net_stats counters
+#define NET_CMD_BEACON 0x12             // beacon broadcast by relays: hops to the gateway
+#define NET_CMD_ROUTES 0x13             // reply with the next hop and the route entries
 
 // Global variables that are managed by the network module
 extern bool node_enabled;       // global variable that enables/disables all code modules
@@ -28,28 +318,122 @@ extern uint8_t node_id;         // this node's rf12 ID
 
 class Net : public Configured {
   // variables related to sending packets
-  net_packet buf[NET_PKT];      // buffer for outgoing packets
-  uint8_t bufCnt;               // number of outgoing packets in buffer
-  uint8_t sendCnt;              // number of transmissions of last packet
-  uint32_t sendTime;            // when last packet was sent (for retries)
-  uint8_t queuedAck;            // header of queued ACK
-  uint8_t queuedRssi;           // RSSI being sent back with ACK
+  net_packet buf[NET_PKT];      // ring of outgoing packet buffers
+  uint8_t bufHead;              // oldest buffer in the ring
+  uint8_t bufCnt;               // number of buffers in use from bufHead on (incl. holes)
+  uint8_t txSeq;                // sequence number for the next packet that isn't ACKed, also
+                                // used to number all packets in the order they're queued
+  net_ack acks[NET_ACKQ];       // queued ACKs, oldest first
+  uint8_t ackCnt;               // number of queued ACKs
+  net_peer peers[NET_PEERS];    // link state for destinations
+  uint8_t rrDest;               // destination served last, for round-robin scheduling
+#if NET_AGG_MS > 0
+  net_handle aggHandle;         // buffer being filled with an aggregate packet, 0 if none
+  uint8_t aggLen;               // length of the aggregate so far
+  uint8_t aggCnt;               // number of records in the aggregate
+  bool aggAck;                  // whether any of the records asked for an ACK
+  uint32_t aggStart;            // when the first record was added
+#endif
+#if NET_RELAY > 0
+  net_route routes[NET_RELAY];  // candidate next hops and nodes reached via relays
+  bool relay;                   // whether this node relays for others
+  uint32_t beaconAt;            // when the last beacon was sent
+  uint8_t announceCnt;          // number of announcements sent
+#endif
 
   // variables related to initialization
   uint16_t nodeUuid;            // uuid sent in init packet
   uint32_t initAt;              // when last init packet was sent, 0 when initialized
   uint8_t group_id;             // rf12 group ID
   bool lowPower;                // whether to reduce tx power and rx gain
+#if NET_ADAPT > 0
+  uint8_t txPower;              // power reduction the radio is set to
+#endif
+#if NET_SLEEPY > 0
+  bool sleepy;                  // whether this node sleeps between packets
+  uint32_t rxUntil;             // when the receive window after the last packet closes
+#endif
+#if NET_TDMA > 0
+  uint8_t slot;                 // this node's slot in the superframe
+  uint16_t slotPhase;           // position in the superframe at slotSyncAt, in ms
+  uint32_t slotSyncAt;          // when the schedule was last synchronized, 0 if never
+#endif
+#if NET_RBCAST > 0
+  net_rbitem rbItems[NET_RBCAST]; // gateway: the last broadcasts, for repair
+  uint8_t rbSlot;               // gateway: entry for the next broadcast
+  uint8_t rbSeq;                // gateway: sequence number of the next broadcast
+  uint8_t rbBeats;              // gateway: heartbeats sent since the last broadcast
+  uint32_t rbBeatAt;            // gateway: when the next heartbeat is due
+  bool rbValid;                 // whether rbNext has been set
+  uint8_t rbNext;               // first broadcast not received yet
+  uint8_t rbHigh;               // one past the newest broadcast known to exist
+  uint8_t rbBits;               // bit n set: broadcast rbNext+n has been received
+  uint8_t nackCnt;              // NACKs sent without progress
+  uint32_t nackAt;              // when to send the next NACK, 0 if nothing is missing
+#endif
+#if NET_CSMA_SLOT > 0
+  uint8_t backoffExp;           // the current backoff is up to 2^backoffExp-1 slots
+  uint32_t backoffAt;           // when the current backoff ends, 0 if none is running
+#endif
 
-  void doSend(void);
+  void doSend(uint8_t i);
+  int8_t nextToSend(void);
+  void ackReceived(uint8_t hdr, uint8_t rssi, uint8_t seq, uint8_t bits, uint8_t to=0);
+  void popAck(uint8_t i);
+  void release(uint8_t i);
+  uint8_t next(uint8_t i) { return ++i == NET_PKT ? 0 : i; }
   void getRssi(void);
-  void queueAck(byte nodeId);
+  void queueAck(byte nodeId, uint8_t seq, uint8_t to=0);
+  net_peer *findPeer(uint8_t id);
+  net_peer *getPeer(uint8_t id);
+  bool stalled(uint8_t dest);
+  uint8_t inFlight(uint8_t dest);
+  bool queued(uint8_t dest);
+  bool isDup(uint8_t src, uint8_t seq);
+  void rttSample(net_peer *pr, uint16_t rtt);
+  void setPower(uint8_t dest);
+  void adaptPower(net_peer *pr, uint8_t rssi);
+  uint16_t rto(net_peer *pr);
+  void sendPeers(void);
+  void sendStats(void);
+  void aggFlush(void);
   void announce(void);
   void handleInit(void);
+  void queue(net_handle h, uint8_t len, uint8_t hdr);
+  bool heldOff(uint8_t dest);
+  bool asleep(uint8_t dest);
+  bool clearToSend(void);
+  bool inSlot(uint8_t s);
+#if NET_RBCAST > 0
+  bool rbReceived(void);
+  void rbShift(uint8_t to);
+  void rbRepair(uint8_t first, uint8_t bits);
+  void rbControl(void);
+#endif
+#if NET_RELAY > 0
+  net_route *findRoute(uint8_t id);
+  net_route *getRoute(uint8_t id);
+  void heard(uint8_t src);
+  uint8_t chooseParent(bool viaRelay);
+  uint8_t hopHdr(uint8_t next, uint8_t ack);
+  void wrap(uint8_t *data, uint8_t len, uint8_t hdr);
+  bool reroute(net_packet *p);
+  void forward(net_handle h);
+  bool beaconDue(void);
+  void beacon(void);
+  void sendRoutes(void);
+#endif
 
 public:
   uint8_t lastAckRssi;          // RSSI received in the last ACK
   uint8_t lastRcvRssi;          // RSSI of the last received packet
+  uint8_t lastRcvLen;           // on-air length of the last received packet, before Net
+                                // stripped its own headers and trailer, see airtime()
+  net_stats stats;              // diagnostic counters
+#if NET_RELAY > 0
+  uint8_t parent;               // next hop toward the gateway, NET_GW_NODE if direct
+  uint8_t hops;                 // transmissions it takes to get to the gateway
+#endif
 
   // Constructor, doesn't init any HW yet; the HW is configured by applyConfig() which is
   // called by the EEPROM config system after the EEPROM is read
@@ -59,22 +443,50 @@ public:
 
   // alloc allocates a packet buffer, allowing multiple packets to be queued. This comes
   // in handy particularly when data packets and debug message packets are sent in rapid
-  // succession.
-  // @return pointer to buffer (corresponding to data payload) or null if no buffer is available
-  uint8_t *alloc(void);
+  // succession. Several buffers may be allocated at the same time and filled in any order,
+  // packets to the same destination are transmitted in the order in which they're sent.
+  // If all buffers are in use the oldest packet queued for a stalled destination (one that
+  // stopped ACKing) is dropped to make room, else the oldest of the lowest priority queued
+  // packets is evicted if its priority is lower than the new one's.
+  // Each alloc must be followed by a send, rawSend, bcast, rbcast, or cancel call on the handle.
+  // @prio is the priority of the packet, NET_PRIO_*
+  // @return handle of the buffer or 0 if no buffer is available
+  net_handle alloc(uint8_t prio=NET_PRIO_TELEM);
+
+  // data returns the payload of an allocated buffer, which may be at most NET_MAXDATA bytes
+  uint8_t *data(net_handle h) { return buf[h-1].data; }
 
-  // send the last allocated buffer as a packet to the management server. Note that
-  // this means that each alloc call must be followed by a send or bcast call.
+  // send an allocated buffer as a packet to the management server. With NET_AGG_MS > 0 the
+  // packet may be combined with other packets and sent up to NET_AGG_MS later.
+  // @h is the handle returned by alloc
   // @len is the length of the payload
   // @ack says whether an ACK should be requested
-  void send(uint8_t len, bool ack=true);
+  void send(net_handle h, uint8_t len, bool ack=true);
 
 	// raw form of send where full header gets passed-in, used by GW to forward from ethernet
-	void rawSend(uint8_t len, uint8_t hdr);
+	void rawSend(net_handle h, uint8_t len, uint8_t hdr);
+
+  // bcast broadcasts an allocated buffer as a packet to all nodes.
+  // @h is the handle returned by alloc
+  // @len is the length of the payload
+  void bcast(net_handle h, uint8_t len);
+
+#if NET_RBCAST > 0
+  // rbcast broadcasts an allocated buffer to all nodes like bcast, but nodes that miss it
+  // get it again (see NET_RBCAST), only the gateway may call it
+  // @h is the handle returned by alloc
+  // @len is the length of the payload, at most NET_MAXDATA-NET_RB_HDR
+  void rbcast(net_handle h, uint8_t len);
+#endif
+
+  // cancel returns an allocated buffer without sending it
+  void cancel(net_handle h);
 
-  // bcast broadcasts the last allocated buffer as a packet to all nodes.
+  // airtime returns how long it takes to send a packet, from the start of the transmission
+  // until the receiver has it
   // @len is the length of the payload
-  void bcast(uint8_t len);
+  // @return the time in us
+  uint16_t airtime(uint8_t len);
 
   // poll must be called in the arduino loop() function to keep the network moving (both
   // send and receive)
@@ -83,9 +495,53 @@ public:
 
   void reXmit(void);
 
+#if NET_SLEEPY > 0
+  // setSleepy tells Net that this node sleeps between packets (see NET_SLEEPY)
+  void setSleepy(bool on) { sleepy = on; }
+
+  // idle returns true when there's nothing to send, no ACK outstanding, and the receive
+  // window after the last packet has closed, i.e. when the node can go to sleep
+  bool idle(void);
+
+  // sleep turns off the radio and powers down the MCU for ms milliseconds if Net is idle,
+  // or less if the next announcement is due earlier or another interrupt wakes the MCU.
+  // The sketch must define ISR(WDT_vect) { Sleepy::watchdogEvent(); }
+  // @return the time slept in ms, 0 if Net isn't idle
+  uint32_t sleep(uint32_t ms);
+#endif
+
+#if NET_TDMA > 0
+  // syncSlots aligns the slotted schedule to the time, NetTime calls it whenever its clock
+  // is set
+  // @t is the time in seconds
+  // @ms is the milliseconds
+  void syncSlots(uint32_t t, uint16_t ms);
+#endif
+
+  // peerInfo fills pkt with the NET_CMD_PEERS reply: module(8), cmd(8), then per peer: id(8),
+  // retryMax(8), fails(8), srtt(16), rttvar(16), rto(16) in ms, as many peers as fit
+  // @return the length
+  uint8_t peerInfo(uint8_t *pkt, uint8_t max);
+
+  // statsInfo fills pkt with the NET_CMD_STATS reply: module(8), cmd(8), net_stats
+  // @return the length, 0 if it doesn't fit
+  uint8_t statsInfo(uint8_t *pkt, uint8_t max);
+
+#if NET_RELAY > 0
+  // setRelay turns relaying for other nodes on or off, it should only be turned on in nodes
+  // that are always awake since other nodes depend on them
+  void setRelay(bool on) { relay = on; }
+
+  // routeInfo fills pkt with the NET_CMD_ROUTES reply: module(8), cmd(8), parent(8), hops(8),
+  // then per route entry: id(8), via(8), hops(8), rssi(8), age(8) in seconds
+  // @return the length
+  uint8_t routeInfo(uint8_t *pkt, uint8_t max);
+#endif
+
   // Configuration methods
 	virtual void applyConfig(uint8_t *);
-	virtual void receive(volatile uint8_t *pkt, uint8_t len);
+	virtual void receive(volatile uint8_t *pkt, uint16_t len);
+  virtual uint8_t call(volatile uint8_t *pkt, uint8_t len, uint8_t *reply, uint8_t *replyLen);
   void setNodeId(uint8_t id);
 };
 
@@ -6,3 +6,5 @@
 #include <Log.h>
 #include <Time.h>
 #include <NetTime.h>
+#include <NetFrag.h>
+#include <NetRpc.h>
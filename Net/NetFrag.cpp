@@ -0,0 +1,144 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Fragmentation layer
+
+#include <JeeLib.h>
+#include <Config.h>
+#include <Net.h>
+#include <NetFrag.h>
+
+// constructor
+NetFrag::NetFrag(void) {
+  moduleId = FRAG_MODULE;
+  configSize = 0;
+  txMsg = 0;
+  txId = 0;
+  drops = 0;
+#if NET_FRAG_BUF > 0
+  memset(rx, 0, sizeof(rx));
+#endif
+}
+
+// ===== Sending =====
+
+bool NetFrag::send(uint8_t *msg, uint16_t len, uint8_t prio) {
+  if (txMsg || len < 1 || len > NET_FRAG_MAX) return false;
+
+  // short messages go out as a single normal packet
+  if (len <= NET_MAXDATA) {
+    net_handle h = net.alloc(prio);
+    if (!h) return false;
+    memcpy(net.data(h), msg, len);
+    net.send(h, len, true);
+    return true;
+  }
+
+  txMsg = msg;
+  txLen = len;
+  txIdx = 0;
+  txId++;
+  txPrio = prio;
+  poll();
+  return true;
+}
+
+void NetFrag::poll(void) {
+  // hand as many fragments to Net as it has buffers for
+  while (txMsg) {
+    net_handle h = net.alloc(txPrio);
+    if (!h) break;
+    uint16_t off = txIdx * NET_FRAG_DATA;
+    uint8_t len = NET_FRAG_DATA;
+    bool last = off + len >= txLen;
+    if (last) len = txLen - off;
+
+    uint8_t *pkt = net.data(h);
+    pkt[0] = FRAG_MODULE;
+    pkt[1] = txId;
+    pkt[2] = txIdx | (last ? NET_FRAG_LAST : 0);
+    memcpy(pkt+NET_FRAG_HDR, txMsg+off, len);
+    net.send(h, NET_FRAG_HDR+len, true);
+
+    txIdx++;
+    if (last) txMsg = 0;
+  }
+
+#if NET_FRAG_BUF > 0
+  // time out incomplete messages
+  for (uint8_t i=0; i<NET_FRAG_SLOTS; i++) {
+    if (rx[i].state != NET_FRAG_FREE && (millis() - rx[i].start) >= NET_FRAG_MS) {
+      if (rx[i].state == NET_FRAG_RECV) drops++;
+      rx[i].state = NET_FRAG_FREE;
+    }
+  }
+#endif
+}
+
+// ===== Reassembly =====
+
+#if NET_FRAG_BUF > 0
+// Find the slot for a message, or allocate a fresh one. A new message from a sender replaces
+// the previous one since senders only send one message at a time. A slot whose message has
+// been dispatched is only taken over by another sender if there's no free one.
+NetFrag::frag_slot *NetFrag::getSlot(uint8_t src, uint8_t id) {
+  frag_slot *free = 0;
+  for (uint8_t i=0; i<NET_FRAG_SLOTS; i++) {
+    frag_slot *s = &rx[i];
+    if (s->state != NET_FRAG_FREE && s->src == src) {
+      if (s->id == id) return s;
+      if (s->state == NET_FRAG_RECV) drops++;
+      free = s;
+      break;
+    }
+    if (s->state == NET_FRAG_FREE && (!free || free->state != NET_FRAG_FREE)) free = s;
+    else if (s->state == NET_FRAG_DONE && !free) free = s;
+  }
+  if (free) {
+    free->state = NET_FRAG_RECV;
+    free->src = src;
+    free->id = id;
+    free->last = 0xFF;
+    free->have = 0;
+    free->start = millis();
+  }
+  return free;
+}
+#endif
+
+// Receive a fragment, the sender is identified by the rf12 header of the packet
+void NetFrag::receive(volatile uint8_t *pkt, uint16_t len) {
+#if NET_FRAG_BUF > 0
+  if (len < NET_FRAG_HDR-1) return;
+  uint8_t idx = pkt[1] & ~NET_FRAG_LAST;
+  if (idx >= NET_FRAG_CNT) return;
+  frag_slot *s = getSlot(rf12_hdr & (RF12_HDR_DST|RF12_HDR_MASK), pkt[0]);
+  if (!s) { drops++; return; } // all slots busy
+  if (s->state != NET_FRAG_RECV) return;
+
+  // copy the fragment into place, fragments may arrive out of order
+  uint16_t off = idx * NET_FRAG_DATA;
+  len -= NET_FRAG_HDR-1;
+  if (off + len > NET_FRAG_BUF) {
+    s->state = NET_FRAG_SKIP;
+    drops++;
+    return;
+  }
+  memcpy(s->data+off, (uint8_t *)pkt+NET_FRAG_HDR-1, len);
+  s->have |= 1UL << idx;
+  if (pkt[1] & NET_FRAG_LAST) {
+    s->last = idx;
+    s->len = off + len;
+  }
+
+  // dispatch the message once all fragments are there, then keep the slot for a while so a
+  // late duplicate of a fragment doesn't start the message over
+  if (s->last != 0xFF && s->have == (0xFFFFFFFFUL >> (31 - s->last))) {
+    s->state = NET_FRAG_DONE;
+    s->start = millis();
+    config_dispatch(s->data, s->len);
+  }
+#endif
+}
+
+void NetFrag::applyConfig(uint8_t *cf) {
+}
@@ -0,0 +1,95 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Fragmentation layer: sends messages larger than a packet as a series of FRAG_MODULE
+// packets and reassembles them on the receiving end.
+// Each fragment carries a 3-byte header: FRAG_MODULE, message id, fragment index (bit 7 set
+// on the last fragment) followed by up to NET_FRAG_DATA bytes of the message. The message
+// itself starts with the module id of its destination, just like a normal packet.
+
+#ifndef NETFRAG_H
+#define NETFRAG_H
+
+// Assumes Config.h and Net.h are included
+
+#define NET_FRAG_HDR   3                        // header: FRAG_MODULE, msg id, index|last
+#define NET_FRAG_DATA  (NET_MAXDATA-NET_FRAG_HDR) // message bytes per fragment
+#define NET_FRAG_LAST  0x80                     // index flag marking the last fragment
+#define NET_FRAG_CNT   32                       // max fragments per message
+#define NET_FRAG_MAX   (NET_FRAG_CNT*NET_FRAG_DATA) // max message length
+
+// Reassembly buffers: NET_FRAG_SLOTS messages of up to NET_FRAG_BUF bytes each can be in
+// the process of being received at the same time. The default of 0 bytes disables reassembly,
+// which is what most nodes want: they only ever send large messages.
+#ifndef NET_FRAG_BUF
+#define NET_FRAG_BUF   0                        // size of a reassembly buffer
+#endif
+#ifndef NET_FRAG_SLOTS
+#define NET_FRAG_SLOTS 1                        // number of reassembly buffers
+#endif
+#ifndef NET_FRAG_MS
+#define NET_FRAG_MS    4000                     // reassembly timeout in ms
+#endif
+#if NET_FRAG_BUF > NET_FRAG_MAX
+#error "NET_FRAG_BUF must not be larger than NET_FRAG_MAX"
+#endif
+
+// Reassembly slot states
+#define NET_FRAG_FREE  0                        // unused
+#define NET_FRAG_RECV  1                        // receiving fragments
+#define NET_FRAG_SKIP  2                        // message too large, skipping its fragments
+#define NET_FRAG_DONE  3                        // dispatched, ignoring late duplicates
+
+class NetFrag : public Configured {
+
+#if NET_FRAG_BUF > 0
+  typedef struct {
+    uint8_t state;              // NET_FRAG_*
+    uint8_t src;                // rf12 header bits identifying the sender (DST|MASK)
+    uint8_t id;                 // message id
+    uint8_t last;               // index of the last fragment, 0xFF while not yet received
+    uint16_t len;               // message length, known once the last fragment arrived
+    uint32_t have;              // bitmap of the fragments received
+    uint32_t start;             // when the first fragment arrived
+    uint8_t data[NET_FRAG_BUF]; // message being reassembled
+  } frag_slot;
+
+  frag_slot rx[NET_FRAG_SLOTS];
+
+  frag_slot *getSlot(uint8_t src, uint8_t id);
+#endif
+
+  uint8_t *txMsg;               // message being sent, 0 if none
+  uint16_t txLen;               // length of the message being sent
+  uint8_t txIdx;                // index of the next fragment to send
+  uint8_t txId;                 // id of the message being sent
+  uint8_t txPrio;               // priority of the fragments
+
+public:
+  uint8_t drops;                // messages that couldn't be reassembled (timeout, too large)
+
+	// constructor
+  NetFrag(void);
+
+  // send a message of up to NET_FRAG_MAX bytes to the management server, the first byte of
+  // the message being the module id. Messages that fit into a packet are sent as is. The
+  // fragments are handed to net.send() as packet buffers become available, so the message
+  // must remain unchanged until busy() returns false.
+  // @msg is the message
+  // @len is the length of the message
+  // @prio is the priority of the fragments, NET_PRIO_*
+  // @return false if another message is still being sent or the message is too long
+  bool send(uint8_t *msg, uint16_t len, uint8_t prio=NET_PRIO_TELEM);
+
+  // busy returns true while the fragments of a message are being handed to Net
+  bool busy(void) { return txMsg != 0; }
+
+  // poll must be called in the arduino loop() function, it sends pending fragments and
+  // times out incomplete messages
+  void poll(void);
+
+  // Configuration methods
+	virtual void applyConfig(uint8_t *);
+	virtual void receive(volatile uint8_t *pkt, uint16_t len);
+};
+
+#endif // NETFRAG_H
@@ -0,0 +1,143 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// RPC layer
+
+#include <JeeLib.h>
+#include <util/crc16.h>
+#include <Config.h>
+#include <Net.h>
+#include <NetFrag.h>
+#include <NetRpc.h>
+
+// constructor
+NetRpc::NetRpc(NetFrag *frag) {
+  moduleId = RPC_MODULE;
+  configSize = 0;
+  served = 0;
+  this->frag = frag;
+#if RPC_CACHE > 0
+  memset(cache, 0, sizeof(cache));
+  cacheNext = 0;
+#endif
+}
+
+// Send the config of all modules as a fragmented message, returns the status
+uint8_t NetRpc::snapshot(uint8_t *pkt) {
+#if RPC_SNAP_BUF > 0
+  if (!frag) return RPC_EOP;
+  if (frag->busy()) return RPC_EBUSY;
+  uint16_t n = RPC_HDR;
+  Configured *cf;
+  for (uint8_t i=0; (cf = config_get(i)) != 0; i++) {
+    if (cf->configSize == 0) continue;
+    if (n + 3 + cf->configSize > RPC_SNAP_BUF) return RPC_ESIZE;
+    snap[n] = cf->moduleId;
+    snap[n+1] = cf->configVersion;
+    snap[n+2] = config_read(cf->moduleId, snap+n+3) ? cf->configSize : 0;
+    n += 3 + snap[n+2];
+  }
+  memcpy(snap, pkt, RPC_HDR);
+  snap[3] = RPC_REPLY | RPC_OK;
+  return frag->send(snap, n, NET_PRIO_CTL) ? RPC_OK : RPC_EBUSY;
+#else
+  return RPC_EOP;
+#endif
+}
+
+// Write and apply the config blocks in a batch, returns the status
+uint8_t NetRpc::batch(uint8_t *args, uint8_t len) {
+  if (len == 0 || !config_write_batch(args, len)) return RPC_EARGS;
+  // note the modules in the batch, an applyConfig() may reuse the receive buffer to send
+  uint8_t ids[256/8];
+  memset(ids, 0, sizeof(ids));
+  for (uint16_t i=0; i < len; i += 2+args[i+1]) ids[args[i] >> 3] |= 1 << (args[i] & 7);
+  // apply their blocks from EEPROM
+  uint8_t block[EEPROM_MAX];
+  Configured *cf;
+  for (uint8_t i=0; (cf = config_get(i)) != 0; i++) {
+    if ((ids[cf->moduleId >> 3] & (1 << (cf->moduleId & 7))) &&
+        config_read(cf->moduleId, block))
+      cf->applyConfig(block);
+  }
+  return RPC_OK;
+}
+
+uint8_t NetRpc::serve(volatile uint8_t *req, uint16_t len, uint8_t *pkt) {
+  uint8_t id = req[0], module = req[1], op = req[2], n = 0, status;
+#if RPC_CACHE > 0
+  // a request that was served already, i.e. its reply got lost, gets the same reply again
+  uint16_t crc = ~0;
+  for (uint16_t i=0; i<len; i++) crc = _crc16_update(crc, req[i]);
+  for (uint8_t i=0; i<RPC_CACHE; i++) {
+    rpc_cached *c = &cache[i];
+    if (c->len > 0 && c->reply[1] == id && c->crc == crc) {
+      memcpy(pkt, c->reply, c->len);
+      return c->len;
+    }
+  }
+#endif
+  Configured *cf = config_find(module);
+  volatile uint8_t *args = req + RPC_HDR-1;
+  len -= RPC_HDR-1;
+  pkt[0] = RPC_MODULE;
+  pkt[1] = id;
+  pkt[2] = module;
+  if (module == 0 && op == RPC_SNAPSHOT) {
+    status = snapshot(pkt);
+    if (status == RPC_OK) { served++; return 0; }
+  } else if (module == 0 && op == RPC_BATCH) {
+    status = len > 255 ? RPC_EARGS : batch((uint8_t *)args, len);
+  } else if (!cf || cf == this) {
+    status = RPC_ENOMOD;
+  } else if (op == RPC_CALL) {
+    status = len > 255 ? RPC_EARGS : cf->call(args, len, pkt+RPC_HDR, &n);
+  } else if (op == RPC_READ) {
+    if (cf->configSize > RPC_MAXREPLY) status = RPC_ESIZE;
+    else if (!config_read(cf->moduleId, pkt+RPC_HDR)) status = RPC_EFAIL;
+    else { n = cf->configSize; status = RPC_OK; }
+  } else if (op == RPC_WRITE) {
+    if (len != cf->configSize || len == 0) {
+      status = RPC_EARGS;
+    } else {
+      // the args are in the receive buffer, which applyConfig may reuse to send a packet
+      uint8_t block[NET_MAXDATA];
+      memcpy(block, (uint8_t *)args, len);
+      config_write(cf->moduleId, block);
+      cf->applyConfig(block);
+      status = RPC_OK;
+    }
+  } else {
+    status = RPC_EOP;
+  }
+  pkt[3] = RPC_REPLY | status;
+  served++;
+#if RPC_CACHE > 0
+  if (status != RPC_EBUSY) {
+    rpc_cached *c = &cache[cacheNext];
+    cacheNext = (cacheNext + 1) % RPC_CACHE;
+    c->crc = crc;
+    c->len = RPC_HDR + n;
+    memcpy(c->reply, pkt, c->len);
+  }
+#endif
+  return RPC_HDR + n;
+}
+
+void NetRpc::reply(net_handle h, uint8_t len) {
+  net.send(h, len, true);
+}
+
+// ===== Configuration =====
+
+// Receive a request, replies from other nodes that were overheard are ignored
+void NetRpc::receive(volatile uint8_t *pkt, uint16_t len) {
+  if (len < RPC_HDR-1 || (pkt[2] & RPC_REPLY)) return;
+  net_handle h = net.alloc(NET_PRIO_CTL);
+  if (!h) return;
+  uint8_t n = serve(pkt, len, net.data(h));
+  if (n) reply(h, n);
+  else net.cancel(h);
+}
+
+void NetRpc::applyConfig(uint8_t *cf) {
+}
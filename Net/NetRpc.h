@@ -0,0 +1,111 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// RPC layer: lets the management server make requests to the modules of a node and get a
+// reply for each one that says whether it took effect. A request is an RPC_MODULE packet:
+// RPC_MODULE, request id, module id, op, arguments. The reply is sent back to the management
+// server via the gateway: RPC_MODULE, request id, module id, RPC_REPLY|status, data. The
+// request id is chosen by the management server and only echoed, so it can have several
+// requests outstanding to a node (up to the window of Net) and match the replies to them.
+//
+// The ops are:
+//  - RPC_CALL: the arguments are a command for the module's call() method, by default
+//    that's what its receive() method gets, the reply data is whatever call() returns
+//  - RPC_READ: the reply data is the module's config block as stored in EEPROM
+//  - RPC_WRITE: the arguments are a new config block (exactly configSize bytes), it's
+//    written to EEPROM and applied with applyConfig()
+//  - RPC_SNAPSHOT (module id 0): the reply data is the config of every module that has one:
+//    module id, config version, size, and the config block (size 0 if it has none yet). The
+//    reply is sent as a single message via NetFrag, which needs RPC_SNAP_BUF bytes of RAM.
+//  - RPC_BATCH (module id 0): the arguments are config blocks for several modules: module id,
+//    size, and the config block for each. All of them are written to EEPROM with a single
+//    commit, so either all or none take effect, and applied. A batch with a module that has no
+//    config, a module twice, or a block of the wrong size gets RPC_EARGS and nothing is
+//    written. A batch that doesn't fit into a packet is sent fragmented, the node then needs
+//    NET_FRAG_BUF and a NetFrag module.
+//
+// A request that finds no free packet buffer for its reply isn't executed, the management
+// server times out and sends it again. It also sends a request again when the reply got lost,
+// so the node keeps the replies to the last RPC_CACHE requests it served, with the request id
+// and a CRC of the request, and sends the same reply again for a repeated request instead of
+// executing it twice. Snapshots and RPC_EBUSY replies aren't kept, those requests are simply
+// executed again.
+
+#ifndef NETRPC_H
+#define NETRPC_H
+
+// Assumes Config.h, Net.h, and NetFrag.h are included
+
+#define RPC_HDR        4                        // RPC_MODULE, request id, module, op|status
+#define RPC_REPLY      0x80                     // flag marking a reply in the op|status byte
+#define RPC_MAXREPLY   (NET_MAXDATA-RPC_HDR)    // max reply data
+
+// Ops of a request
+#define RPC_CALL       0                        // call() of the module
+#define RPC_READ       1                        // read the config block
+#define RPC_WRITE      2                        // write and apply the config block
+#define RPC_SNAPSHOT   3                        // read the config blocks of all modules
+#define RPC_BATCH      4                        // write and apply several config blocks
+
+// Size of the buffer for the reply to RPC_SNAPSHOT, the default of 0 disables it to save
+// RAM. The config of all modules plus RPC_HDR and 3 bytes per module needs to fit.
+#ifndef RPC_SNAP_BUF
+#define RPC_SNAP_BUF   0
+#endif
+#if RPC_SNAP_BUF > NET_FRAG_MAX
+#error "RPC_SNAP_BUF must not be larger than NET_FRAG_MAX"
+#endif
+
+// Number of replies kept for repeated requests, each takes NET_MAXDATA+3 bytes of RAM, 0
+// turns replaying them off
+#ifndef RPC_CACHE
+#define RPC_CACHE      2
+#endif
+
+// A reply kept for a repeated request
+typedef struct {
+  uint16_t  crc;                // CRC of the request
+  uint8_t   len;                // length of the reply, 0 if the entry is unused
+  uint8_t   reply[NET_MAXDATA]; // the reply, its request id is reply[1]
+} rpc_cached;
+
+class NetRpc : public Configured {
+  NetFrag *frag;                // sends the reply to RPC_SNAPSHOT
+#if RPC_SNAP_BUF > 0
+  uint8_t snap[RPC_SNAP_BUF];   // reply to RPC_SNAPSHOT while it's being sent
+#endif
+#if RPC_CACHE > 0
+  rpc_cached cache[RPC_CACHE];  // replies to the last requests served
+  uint8_t cacheNext;            // entry that's replaced next
+#endif
+
+  uint8_t snapshot(uint8_t *pkt);
+  uint8_t batch(uint8_t *args, uint8_t len);
+
+protected:
+  // reply sends the reply to the management server, the gateway overrides it to send the
+  // replies to requests addressed to itself over the ethernet
+  // @h is the packet buffer holding the reply
+  // @len is the length of the reply
+  virtual void reply(net_handle h, uint8_t len);
+
+public:
+  uint16_t served;              // number of requests executed
+
+	// constructor
+  // @frag is the NetFrag module that sends the reply to RPC_SNAPSHOT, 0 if not supported
+  NetRpc(NetFrag *frag=0);
+
+  // serve executes a request and places the reply into a packet buffer, or the reply it gave
+  // before if the request was served already
+  // @req is the request, starting with the request id
+  // @len is the length of the request
+  // @pkt is where the reply goes, it needs room for NET_MAXDATA bytes
+  // @return the length of the reply, 0 if it was sent as a fragmented message instead
+  uint8_t serve(volatile uint8_t *req, uint16_t len, uint8_t *pkt);
+
+  // Configuration methods
+	virtual void applyConfig(uint8_t *);
+	virtual void receive(volatile uint8_t *pkt, uint16_t len);
+};
+
+#endif // NETRPC_H
@@ -0,0 +1,98 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Serial link for wired nodes, see NetSerial.h for the frame format
+
+#ifdef NET_SERIAL
+
+#include <JeeLib.h>
+#include <util/crc16.h>
+#include <NetSerial.h>
+
+static uint8_t serId, serGroup;         // set by ser_initialize
+
+// Receive state, the frame is decoded straight into rf12_buf
+static uint8_t rxLen;                   // number of bytes decoded so far
+static uint8_t rxCode;                  // bytes left in the current COBS block
+static uint8_t rxBlock;                 // code byte of the current block, 0 before the first
+static bool rxSkip;                     // discard everything up to the next delimiter
+
+void ser_initialize(uint8_t id, uint8_t group) {
+  serId = id & RF12_HDR_MASK;
+  serGroup = group;
+  NET_SER_PORT.flush();
+  NET_SER_PORT.begin(NET_SER_BAUD);
+  // we may have come in in the middle of a frame
+  rxSkip = true;
+}
+
+// Append a decoded byte to the frame, a frame that's too long can't be valid
+static void rxPut(uint8_t c) {
+  if (rxLen < 3+RF12_MAXDATA+2) rf12_buf[rxLen++] = c;
+  else rxSkip = true;
+}
+
+uint8_t ser_recvDone(void) {
+  while (NET_SER_PORT.available() > 0) {
+    uint8_t c = NET_SER_PORT.read();
+    if (c == 0) {
+      // delimiter: check what we've got and start over, frames with a length that doesn't
+      // match are garbage (or debug output) rather than packets with a bad CRC
+      uint8_t n = rxLen;
+      bool ok = !rxSkip && rxCode == 0 && n >= 5 && rf12_len == n-5;
+      rxLen = rxCode = rxBlock = 0;
+      rxSkip = false;
+      if (!ok) continue;
+      uint16_t crc = ~0;
+      for (uint8_t i=0; i<n; i++) crc = _crc16_update(crc, rf12_buf[i]);
+      rf12_crc = crc;
+      // filter like the radio does: our group and either broadcast or addressed to us
+      if (crc == 0 && (rf12_grp != serGroup || ((rf12_hdr & RF12_HDR_DST) &&
+          (rf12_hdr & RF12_HDR_MASK) != serId && serId != 31)))
+        continue;
+      return 1;
+    }
+    if (rxSkip) continue;
+    if (rxCode == 0) {
+      // code byte: the block before it ended with a zero unless it was a full block
+      if (rxBlock != 0 && rxBlock != 0xFF) rxPut(0);
+      rxBlock = c;
+      rxCode = c-1;
+    } else {
+      rxPut(c);
+      rxCode--;
+    }
+  }
+  return 0;
+}
+
+uint8_t ser_canSend(void) {
+  return 1;
+}
+
+// Frames are short enough that COBS never needs a full (0xFF) block
+void ser_sendStart(uint8_t hdr, const void *ptr, uint8_t len) {
+  uint8_t f[3+RF12_MAXDATA+2];
+  if (len > RF12_MAXDATA) len = RF12_MAXDATA;
+  f[0] = serGroup;
+  f[1] = hdr & RF12_HDR_DST ? hdr : (hdr & ~RF12_HDR_MASK) | serId;
+  f[2] = len;
+  memcpy(f+3, ptr, len);
+  uint8_t n = 3+len;
+  uint16_t crc = ~0;
+  for (uint8_t i=0; i<n; i++) crc = _crc16_update(crc, f[i]);
+  f[n++] = crc;
+  f[n++] = crc >> 8;
+
+  NET_SER_PORT.write((uint8_t)0);
+  uint8_t i = 0;
+  do {
+    uint8_t j = i;
+    while (j < n && f[j] != 0) j++;
+    NET_SER_PORT.write((uint8_t)(j-i+1));
+    NET_SER_PORT.write(f+i, j-i);
+    i = j+1;
+  } while (i <= n);
+  NET_SER_PORT.write((uint8_t)0);
+}
+
+#endif // NET_SERIAL
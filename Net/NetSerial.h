@@ -0,0 +1,47 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Serial link for wired nodes (NET_SERIAL builds), it stands in for the rf12 driver so Net
+// works the same over a serial port as over the radio, including ACKs and retransmissions.
+//
+// Each packet is sent as a binary frame: the rf12 group, header, length, and payload followed
+// by the rf12 CRC-16 (low byte first), COBS encoded and with a 0x00 delimiter before and after.
+// COBS adds one byte per 254 instead of the 33% of Base64 and guarantees that 0x00 only ever
+// appears as delimiter, so a receiver resynchronizes at the next frame after garbage or lost
+// bytes. Debug output printed to the same port ends up between frames where the receiver
+// discards it (a PC on the other end can display it).
+//
+// The bytes are received by the interrupt handler of the HardwareSerial port into its ring
+// buffer and decoded when Net polls, received packets end up in rf12_buf just like with the
+// radio. With the 64-byte ring of the Arduino core, loop() must call Net::poll at least every
+// 5ms at 115200 baud or received bytes get lost (and the packets are retransmitted).
+//
+// The link can be tested on Linux, see netser in the sim directory.
+
+#ifndef NETSERIAL_H
+#define NETSERIAL_H
+
+#ifndef NET_SER_PORT
+#define NET_SER_PORT   Serial           // HardwareSerial port the link uses
+#endif
+#ifndef NET_SER_BAUD
+#define NET_SER_BAUD   115200           // baud rate of the link
+#endif
+
+// Frame size on the wire: delimiters, COBS code byte, group, hdr, len, payload, CRC
+#define NET_SER_FRAME  (2+1+3+RF12_MAXDATA+2)
+
+// Configure the port, equivalent of rf12_initialize
+void ser_initialize(uint8_t id, uint8_t group);
+
+// Decode the bytes received so far, returns 1 once a frame has been received and placed into
+// rf12_buf; rf12_crc is 0 if the frame was received intact. Frames for other groups or
+// addressed to other nodes are dropped.
+uint8_t ser_recvDone(void);
+
+// Whether a packet can be sent, always true: the port buffers what's sent
+uint8_t ser_canSend(void);
+
+// Send a packet, hdr and payload are the same as for rf12_sendStart
+void ser_sendStart(uint8_t hdr, const void *ptr, uint8_t len);
+
+#endif // NETSERIAL_H
@@ -9,6 +9,14 @@
 #include <Log.h>
 #include <NetTime.h>
 
+uint32_t NetTime::syncSecs;
+uint16_t NetTime::syncMs;
+uint32_t NetTime::syncAt;
+uint32_t NetTime::driftSecs;
+uint16_t NetTime::driftMs;
+uint32_t NetTime::driftAt;
+int16_t NetTime::drift;
+
 // constructor
 NetTime::NetTime(void) {
 	offset = 0; // UTC default
@@ -16,13 +24,93 @@ NetTime::NetTime(void) {
   configSize = sizeof(nettime_config);
 }
 
+// ===== Clock =====
+
+// Correction in ms for the drift over elapsed ms of millis(), computed in seconds so it
+// doesn't overflow for up to 49 days
+int32_t NetTime::correction(uint32_t elapsed) {
+  uint32_t s = elapsed / 1000;
+  return (int32_t)(s / 1000) * drift + (int32_t)(s % 1000) * drift / 1000;
+}
+
+void NetTime::set(uint32_t t, uint16_t ms) {
+  t += ms / 1000;
+  ms %= 1000;
+  uint32_t at = millis();
+  if (at == 0) at = 1;
+  bool first = syncAt == 0;
+  if (syncAt == 0) {
+    driftSecs = t;
+    driftMs = ms;
+    driftAt = at;
+  } else if (at - driftAt >= NETTIME_DRIFT_MS) {
+    // compare how far the clock and millis() advanced since the start of the measurement,
+    // after the first measurement half the difference goes into the estimate to smooth out
+    // the jitter
+    uint32_t local = at - driftAt;
+    int32_t err = (int32_t)(t - driftSecs) * 1000 + ms - driftMs - (int32_t)local;
+    int32_t ppm = 0x7FFFFFFF;
+    if (t - driftSecs < 2000000 && local < 2000000000 && err < 2000000 && err > -2000000)
+      ppm = err * 1000 / (int32_t)(local / 1000);
+    if (ppm > NETTIME_DRIFT_MAX || ppm < -NETTIME_DRIFT_MAX)
+      drift = 0;                // the clock was stepped, start over
+    else
+      drift = drift == 0 ? ppm : drift + (ppm - drift) / 2;
+    driftSecs = t;
+    driftMs = ms;
+    driftAt = at;
+  }
+  syncSecs = t;
+  syncMs = ms;
+  syncAt = at;
+  // from now on the Time library gets the drift-corrected time from sync()
+  if (first) {
+    setSyncInterval(NETTIME_SYNC_S);
+    setSyncProvider(sync);
+  }
+  setTime(ms >= 500 ? t+1 : t);
+#if NET_TDMA > 0
+  net.syncSlots(t, ms);
+#endif
+}
+
+uint32_t NetTime::get(uint16_t *ms) {
+  if (syncAt == 0) {
+    if (ms) *ms = 0;
+    return 0;
+  }
+  uint32_t elapsed = millis() - syncAt;
+  elapsed += correction(elapsed) + syncMs;
+  if (ms) *ms = elapsed % 1000;
+  return syncSecs + elapsed / 1000;
+}
+
+time_t NetTime::sync(void) {
+  uint16_t ms;
+  uint32_t t = get(&ms);
+  return ms >= 500 ? t+1 : t;
+}
+
+void NetTime::stamp(uint8_t *pkt) {
+  uint16_t ms;
+  uint32_t t = get(&ms);
+  if (t == 0) return;           // leave it to whoever put a time into the packet
+  memcpy(pkt, &t, sizeof(t));
+  memcpy(pkt+4, &ms, sizeof(ms));
+}
+
 // ===== Configuration =====
 
-// Receive a time packet with UTC time
-void NetTime::receive(volatile uint8_t *pkt, uint8_t len) {
+// Receive a time packet with UTC time, the time is when the gateway started sending it
+void NetTime::receive(volatile uint8_t *pkt, uint16_t len) {
   if (len >= 4) {
     bool wasSet = timeStatus();
-    setTime(*(uint32_t *)pkt);
+    uint32_t t;
+    uint16_t ms = 0;
+    memcpy(&t, (uint8_t *)pkt, sizeof(t));
+    if (len >= 6) memcpy(&ms, (uint8_t *)pkt+4, sizeof(ms));
+    // the packet just got here, it took the airtime of the frame as it was sent
+    set(t, ms + (net.airtime(net.lastRcvLen) + 500) / 1000);
     if (!wasSet) logger->println(F("Time initialized"));
   }
 }
@@ -1,11 +1,26 @@
 // Copyright (c) 2013 Thorsten von Eicken
 //
 // Time class, receives time messages and keeps local time up-to-date
+//
+// The gateway broadcasts a time packet: module(8), seconds(32) since the epoch, milliseconds(16).
+// Net fills in the time as the packet is being sent (see NetTime::stamp) and the receiver adds
+// the airtime of the packet, so the nodes' clocks are within a few ms of the gateway's. Between
+// broadcasts each node's clock runs on millis(), corrected by the drift of its crystal (or
+// resonator) measured over the broadcasts it received at least NETTIME_DRIFT_MS apart.
+// The Time library's now() gets the drift-corrected time from this clock every
+// NETTIME_SYNC_S seconds and with each broadcast, rounded to the nearest second. The Time
+// library counts its seconds from the moment it was set, so now() can be up to 0.5s ahead
+// of get() and up to 1.5s behind; get() has the ms.
+// Older gateways send the seconds only, which are taken to be whole seconds.
 
 #ifndef NETTIME_H
 #define NETTIME_H
 
-// Assumes JeeLib.h is included for rf12 constants
+// Assumes JeeLib.h is included for rf12 constants and Time.h for time_t
+
+#define NETTIME_DRIFT_MS  300000        // min time over which the drift is measured
+#define NETTIME_DRIFT_MAX 5000          // max drift in ppm, larger means the clock was stepped
+#define NETTIME_SYNC_S    10            // interval at which now() is synced to get(), seconds
 
 class NetTime : public Configured {
 
@@ -13,16 +28,45 @@ class NetTime : public Configured {
   typedef struct {
     int8_t	offset;	  // time zone offset
   } nettime_config;
+  CONFIG_CHECK(nettime_config);
 
   int8_t offset;
 
+  // The clock, there's one per node, so Net can stamp time packets without a NetTime object
+  static uint32_t syncSecs;     // time at the last sync, seconds
+  static uint16_t syncMs;       // time at the last sync, milliseconds
+  static uint32_t syncAt;       // millis() at the last sync, 0 if the clock isn't set
+  static uint32_t driftSecs;    // time at the start of the drift measurement, seconds
+  static uint16_t driftMs;      // time at the start of the drift measurement, milliseconds
+  static uint32_t driftAt;      // millis() at the start of the drift measurement
+  static int16_t drift;         // ppm that millis() runs slow, negative if it runs fast
+
+  static int32_t correction(uint32_t elapsed);
+  static time_t sync(void);
+
 public:
 	// constructor
 	NetTime(void);
 
+  // set sets the clock, e.g. on the gateway from NTP, and the Time library's clock
+  // @t is the time in seconds since the epoch
+  // @ms is the milliseconds
+  static void set(uint32_t t, uint16_t ms);
+
+  // get returns the current time in seconds since the epoch, 0 if the clock isn't set
+  // @ms if not null gets the milliseconds
+  static uint32_t get(uint16_t *ms);
+
+  // stamp writes the current time into a time packet (after the module byte) as it's sent,
+  // Net calls it for each NETTIME_MODULE packet it sends
+  static void stamp(uint8_t *pkt);
+
+  // getDrift returns the measured drift of millis() in ppm
+  static int16_t getDrift(void) { return drift; }
+
   // Configuration methods
 	virtual void applyConfig(uint8_t *);
-	virtual void receive(volatile uint8_t *pkt, uint8_t len);
+	virtual void receive(volatile uint8_t *pkt, uint16_t len);
 };
 
 #endif // NETTIME_H
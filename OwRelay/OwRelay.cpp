@@ -27,6 +27,7 @@ void OwRelay::init(byte pin, uint8_t count) {
   rlyState = (bool *)calloc(rlyCount, sizeof(bool));
   moduleId = OWRELAY_MODULE;
   configSize = sizeof(uint64_t)*rlyCount;
+  configResizable = true;
 #if DEBUG
 	Serial.print("OWR: count=");
 	Serial.print(rlyCount);
@@ -248,7 +249,7 @@ void OwRelay::applyConfig(uint8_t *cf) {
   }
 }
 
-void OwRelay::receive(volatile uint8_t *pkt, uint8_t len) {
+void OwRelay::receive(volatile uint8_t *pkt, uint16_t len) {
   // sorry, we ain't processing no packets...
 }
 
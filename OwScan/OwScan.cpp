@@ -26,6 +26,7 @@ void OwScan::init(byte pin, uint8_t count) {
 	present = 0;
   moduleId = OWSCAN_MODULE;
   configSize = sizeof(uint32_t)*devMax;
+  configResizable = true;
 #if DEBUG
 	Serial.print("OW: max=");
 	Serial.print(devMax);
@@ -213,7 +214,7 @@ void OwScan::applyConfig(uint8_t *cf) {
   }
 }
 
-void OwScan::receive(volatile uint8_t *pkt, uint8_t len) {
+void OwScan::receive(volatile uint8_t *pkt, uint16_t len) {
   // sorry, we ain't processing no packets...
 }
 
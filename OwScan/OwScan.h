@@ -70,7 +70,7 @@ public:
 
   // Configuration methods
 	virtual void applyConfig(uint8_t *);
-	virtual void receive(volatile uint8_t *pkt, uint8_t len);
+	virtual void receive(volatile uint8_t *pkt, uint16_t len);
 
 private:
   OneWire ds;
@@ -36,6 +36,7 @@ void OwTemp::init(byte pin, uint8_t count) {
   memset(sensMax, 0x80, sensCount*6*sizeof(int8_t));
   moduleId = OWTEMP_MODULE;
   configSize = sizeof(uint32_t)*sensCount;
+  configResizable = true;
 #if DEBUG
 	Serial.print("OWT: count=");
 	Serial.print(sensCount);
@@ -352,7 +353,7 @@ void OwTemp::applyConfig(uint8_t *cf) {
   }
 }
 
-void OwTemp::receive(volatile uint8_t *pkt, uint8_t len) {
+void OwTemp::receive(volatile uint8_t *pkt, uint16_t len) {
   // sorry, we ain't processing no packets...
 }
 
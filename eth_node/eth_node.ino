@@ -34,9 +34,11 @@ static uint32_t num_rf12_rcv = 0;     // counter of rf12 packets received
 static uint32_t num_rf12_snd = 0;     // counter of rf12 packets sent
 static uint32_t num_eth_rcv = 0;      // counter of ethernet packets received
 static uint32_t num_eth_snd = 0;      // counter of ethernet packets sent
+static uint32_t num_rf12_drop = 0;    // counter of ethernet packets dropped for lack of buffers
 
 // the time...
 static uint32_t time, frac;
+static uint32_t ntpSentAt;            // when the last NTP request was sent
 
 //===== Ethernet logging =====
 
@@ -63,9 +65,31 @@ protected:
 LogEth loggerEth;
 Log *logger = &loggerEth;
 
+//===== RPC requests to the gateway itself
+
+class RpcEth : public NetRpc {
+protected:
+  // the reply goes straight back to the management server
+  virtual void reply(net_handle h, uint8_t len) {
+    ether.udpPrepare(msgClientPort, msgServer, msgClientPort);
+    uint8_t *ptr = gPB+UDP_DATA_P;
+
+    // Need to construct fake rf12 packet
+    *ptr++ = 0xD4;  // group
+    *ptr++ = node_id;
+    *ptr++ = len;
+    memcpy(ptr, net.data(h), len);
+    net.cancel(h);
+    ether.udpTransmit(len+3);
+    num_eth_snd++;
+  }
+};
+
+RpcEth rpc;
+
 // modules
 static Configured *(node_config[]) = {
-  &net, &loggerEth, 0
+  &net, &loggerEth, &rpc, 0
 };
 
 //===== ntp response with fractional seconds
@@ -92,7 +116,7 @@ byte msgProcessAnswer() {
   if (gPB[UDP_DST_PORT_L_P] != (msgClientPort & 0xff) ||
       gPB[UDP_DST_PORT_H_P] != (msgClientPort >> 8) ||
       gPB[UDP_LEN_H_P] != 0 ||
-      len < 3 || len > 3+RF12_MAXDATA)
+      len < 3 || len > 3+NET_MAXDATA)
     return 0;
 
   if (len != gPB[UDP_DATA_P+2]+3) {
@@ -106,6 +130,28 @@ byte msgProcessAnswer() {
 
   if (gPB[UDP_DATA_P+1] == (NET_GW_NODE|RF12_HDR_DST)) {
     //logger->println("Packet to self");
+    // the link state, counters, and routes of the gateway go straight back to the management
+    // server, a reply sent over the radio wouldn't get there
+    uint8_t cmd = len >= 5 && gPB[UDP_DATA_P+3] == NET_MODULE ? gPB[UDP_DATA_P+4] : 0;
+    bool info = cmd == NET_CMD_PEERS || cmd == NET_CMD_STATS;
+#if NET_RELAY > 0
+    info |= cmd == NET_CMD_ROUTES;
+#endif
+    if (info) {
+      ether.udpPrepare(msgClientPort, msgServer, msgClientPort);
+      uint8_t *ptr = gPB+UDP_DATA_P;
+      // Need to construct fake rf12 packet
+      ptr[0] = 0xD4;  // group
+      ptr[1] = node_id;
+      if (cmd == NET_CMD_PEERS) ptr[2] = net.peerInfo(ptr+3, NET_MAXDATA);
+      else if (cmd == NET_CMD_STATS) ptr[2] = net.statsInfo(ptr+3, NET_MAXDATA);
+#if NET_RELAY > 0
+      else ptr[2] = net.routeInfo(ptr+3, NET_MAXDATA);
+#endif
+      ether.udpTransmit(ptr[2]+3);
+      num_eth_snd++;
+      return 1;
+    }
     config_dispatch(gPB+UDP_DATA_P+3, len-3);
     return 1;
   }
@@ -120,11 +166,16 @@ byte msgProcessAnswer() {
   logger->println();
 #endif
 
-  uint8_t *pkt = net.alloc();
-  if (pkt) {
+  net_handle h = net.alloc(NET_PRIO_CTL);
+  if (h) {
     uint8_t to=gPB[UDP_DATA_P+1], d=gPB[UDP_DATA_P+3];
-    memcpy(pkt, gPB+UDP_DATA_P+3, len-3);
-    net.rawSend(len-3, gPB[UDP_DATA_P+1]);
+    memcpy(net.data(h), gPB+UDP_DATA_P+3, len-3);
+#if NET_RBCAST > 0
+    // broadcasts from the management server (config pushes) are repaired if nodes miss them
+    if (!(to & RF12_HDR_DST)) net.rbcast(h, len-3);
+    else
+#endif
+    net.rawSend(h, len-3, gPB[UDP_DATA_P+1]);
     num_rf12_snd++;
 #if 0
     logger->print(F("ETH  RCV packet: hdr=0x"));
@@ -135,6 +186,8 @@ byte msgProcessAnswer() {
     logger->print(len-3);
     logger->println();
 #endif
+  } else {
+    num_rf12_drop++;
   }
 
   return 1;
@@ -209,6 +262,7 @@ void loop() {
   // Every few seconds send an NTP time request
   if (ethReady && ntpTimer.poll(5000)) {
     ether.ntpRequest(ntpServer, ntpClientPort);
+    ntpSentAt = millis();
     Serial.println("Sending NTP request");
   }
 
@@ -226,6 +280,10 @@ void loop() {
     ether.sendUdp(msgSelf, sizeof(msgSelf)-1, msgClientPort, msgServer, msgClientPort);
     num_eth_snd++;
     ether.printIp(F("IP: "), ether.myip);
+    if (num_rf12_drop > 0) {
+      logger->print(F("RF12: dropped "));
+      logger->println(num_rf12_drop);
+    }
   }
 
   // Keep rf12 moving
@@ -291,14 +349,25 @@ void loop() {
     } else if (ntpProcessAnswer(&time, &frac, ntpClientPort)) {
       // Unix time starts on Jan 1 1970. In seconds, that's 2208988800:
       const unsigned long seventyYears = 2208988800UL;     
-      // subtract seventy years and set local clock
+      // subtract seventy years and set local clock, frac is in 1/2^32 seconds; the answer
+      // took about half the round trip to get here
       time = time - seventyYears;
-      setTime(time);
-
-      // Try to send it once on the rf12 radio (don't let it get stale)
-      if (rf12_canSend()) {
-        struct net_time { uint8_t module; uint32_t time; } tbuf = { NETTIME_MODULE, time };
-        rf12_sendStart(NET_GW_NODE, &tbuf, sizeof(tbuf));
+      uint16_t ms = (uint16_t)(frac >> 16) * 1000UL >> 16;
+      NetTime::set(time, ms + (millis() - ntpSentAt) / 2);
+
+      // Send it once on the rf12 radio (don't let it get stale), this goes through net so
+      // it gets the same framing as all other packets; net puts the time into the packet
+      // when it's sent, also when it's sent again to a node that missed it (NET_RBCAST)
+      net_handle h = net.alloc(NET_PRIO_CTL);
+      if (h) {
+        uint8_t *pkt = net.data(h);
+        pkt[0] = NETTIME_MODULE;
+        memset(pkt+1, 0, 6);
+#if NET_RBCAST > 0
+        net.rbcast(h, 7);
+#else
+        net.bcast(h, 7);
+#endif
         num_rf12_snd++;
         //logger->println(F("Sent time update"));
       } else {
@@ -4,6 +4,7 @@
 // Functions:
 //   - relay packets pretty much as-is between rf12 and eth
 //   - queries NTP server for current time and broadcasts on rf12 net
+//   - optionally captures all rf12 frames with timestamps and streams them to the hub
 // LEDs:
 //   - red LED on while IP address is 0.0.0.0     (D to gnd LED_RED_PORT)
 //   - green LED toggles when eth pkt received    (D to gnd LED_RCV_PORT)
@@ -41,6 +42,16 @@ static word ntpPort = 123;              // port on which NTP responds
 static byte hubServer[] = { 192, 168, 0, 3 };
 static word hubPort = 9999;             // port on which the hub service runs
 
+// Capture mode: every frame received, including ones with a bad CRC, and every frame sent is
+// recorded with a timestamp and its RSSI, the records are batched into UDP datagrams to the
+// hub's capture port. No per-packet output is printed on the serial port in this mode.
+#define CAPTURE 0                       // whether to capture frames or not
+#if CAPTURE
+static word capPort = 9998;             // port on which the hub receives captured frames
+#define CAP_BUF               240       // max size of a batch (the ethernet buffer is 500)
+#define CAP_MS                 50       // max time a frame waits in a batch
+#endif
+
 //===== end of user configuration =====
 
 // Ethernet data
@@ -71,6 +82,64 @@ static uint8_t ackRssi[RF12_NUMID-2]; // RSSI received from remote node in ACK p
 static uint32_t time, frac;
 #endif
 
+//===== Frame capture =====
+// A batch consists of a 2-byte header: 8-bit batch sequence number, number of frames not
+// captured since the previous batch (for lack of space or ethernet link, saturates at 255).
+// It's followed by a record per frame: 32-bit micros() timestamp (little endian), RSSI, flags
+// (CAP_BADCRC, CAP_SENT), rf12 header, rf12 length, data. The length is as received, which
+// is garbage if the CRC is bad, only the first RF12_MAXDATA bytes of data are included.
+// Received frames are stamped when their reception completes, sent frames when they start.
+
+#if CAPTURE
+#define CAP_HDR                 2       // size of the batch header
+#define CAP_REC                 8       // size of a record before its data
+#define CAP_BADCRC           0x01       // flag: the frame was received with a bad CRC
+#define CAP_SENT             0x02       // flag: the frame was sent by the gateway
+
+static uint8_t capBuf[CAP_BUF];       // batch being filled, header included
+static uint8_t capLen = CAP_HDR;      // bytes used in capBuf
+static uint8_t capSeq;                // sequence number of the next batch
+static uint8_t capCnt;                // number of records in capBuf
+static uint8_t capMissed;             // frames not captured since the last batch
+static uint32_t capAt;                // when the first record of the batch was captured
+
+// Send the batch to the hub, if it has any records, it's dropped if the link is down
+static void capFlush(void) {
+  if (capCnt == 0) return;
+  if (ether.isLinkUp() && !ether.clientWaitingGw()) {
+    capBuf[0] = capSeq++;
+    capBuf[1] = capMissed;
+    ether.udpPrepare(capPort, hubServer, capPort);
+    memcpy(gPB + UDP_DATA_P, capBuf, capLen);
+    ether.udpTransmit(capLen);
+    num_eth_snd++;
+    capMissed = 0;
+  } else {
+    capMissed = capMissed + capCnt < 255 ? capMissed + capCnt : 255;
+  }
+  capLen = CAP_HDR;
+  capCnt = 0;
+}
+
+// Record a frame
+static void capture(uint32_t at, uint8_t rssi, uint8_t flags, uint8_t hdr, uint8_t len,
+    volatile uint8_t *data)
+{
+  uint8_t n = len > RF12_MAXDATA ? RF12_MAXDATA : len;
+  if (capLen + CAP_REC + n > CAP_BUF) capFlush();
+  if (capCnt == 0) capAt = millis();
+  uint8_t *p = capBuf + capLen;
+  *p++ = at; *p++ = at >> 8; *p++ = at >> 16; *p++ = at >> 24;
+  *p++ = rssi;
+  *p++ = flags;
+  *p++ = hdr;
+  *p++ = len;
+  for (uint8_t i=0; i<n; i++) *p++ = data[i];
+  capLen += CAP_REC + n;
+  capCnt++;
+}
+#endif
+
 //===== Ethernet logging =====
 // Simple class that will send text in ethernet messages to the hub server.
 
@@ -177,8 +246,12 @@ byte msgProcessAnswer() {
 	// but we'd need some buffering for that...
 	uint8_t hdr = gPB[UDP_DATA_P+1];
 	rf12_sendNow(hdr, gPB+UDP_DATA_P+3, len-3);
+#if CAPTURE
+  // capture what rf12_sendNow placed in rf12_buf, a flush of the batch overwrites gPB
+  capture(micros(), 0, CAP_SENT, rf12_hdr, rf12_len, rf12_data);
+#endif
 
-#if 1
+#if !CAPTURE
   logger.print(F("ETH  RCV packet: hdr=0x"));
   logger.print(hdr, HEX);
   logger.print(F(" len="));
@@ -349,14 +422,26 @@ void loop() {
   // Receive RF12 packets.
 	// rf12_recvDone returns true if it received a broadcast packet (D=0)
 	// -or- D=1 and the dest is us -or- D=1 and the dest is node 31
+	// It also returns frames with a bad CRC, they're only captured
+  bool rcvd = false;
+  uint8_t rssi = 0;
   if (rf12_recvDone()) {
+    // The timestamp and the RSSI must be taken as soon as possible after reception
+    uint32_t at = micros();
+    rssi = rf12_getRssi();
+#if CAPTURE
+    capture(at, rssi, rf12_crc ? CAP_BADCRC : 0, rf12_hdr, rf12_len, rf12_data);
+#endif
+    rcvd = rf12_crc == 0;
+  }
+  if (rcvd) {
     num_rf12_rcv++;
+    uint8_t node = rf12_hdr & RF12_HDR_MASK;
 
 #if RF12_RSSI
     // Record RSSIs
-    uint8_t node = rf12_hdr & RF12_HDR_MASK;
 		if ((rf12_hdr & RF12_HDR_DST) == 0) { // if the pkt has the source address
-			rcvRssi[node] = rf12_getRssi();
+			rcvRssi[node] = rssi;
 		}
 		if ((rf12_hdr & ~RF12_HDR_MASK) == RF12_HDR_CTL && // ACK pkt with source addr
 			  rf12_len == 1)                                 // and with one data byte
@@ -365,11 +450,11 @@ void loop() {
 		}
 #endif
 
-#if 1
+#if !CAPTURE
     Serial.print("RCV hdr=");
-    Serial.print(rf12_hdr & RF12_HDR_MASK);
+    Serial.print(node);
     Serial.print(" rssi=");
-    Serial.println(rcvRssi[node]);
+    Serial.println(rssi);
 
     logger.print(F("RF12 RCV packet: hdr=0x"));
     logger.print(rf12_hdr, HEX);
@@ -389,6 +474,11 @@ void loop() {
     rcvLed.digiWrite2(1); // yellow on
   }
   
+#if CAPTURE
+  // Send the batch of captured frames once the oldest one has waited long enough
+  if (capCnt > 0 && millis() - capAt >= CAP_MS) capFlush();
+#endif
+
   // Receive ethernet packets
   int plen = ether.packetReceive();
   ether.packetLoop(plen);
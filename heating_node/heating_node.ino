@@ -41,6 +41,10 @@ void setup() {
   //eeprom_write_word((uint16_t *)0x20, 0xF00D);
 
   config_init(node_config);
+#if NET_RELAY > 0
+  // we're always on, so we can pass on the packets of nodes that don't reach the gateway
+  net.setRelay(true);
+#endif
 
   owTemp.setup((Print*)logger);
   owRelay.setup((Print*)logger);
@@ -27,6 +27,7 @@
 Net net(0xD4, true);  // default group_id and low power
 NetTime nettime;
 Log l, *logger=&l;
+NetRpc rpc;
 MilliTimer notSet, lcdUpdate;
 MilliTimer debugTimer;
 OwTemp owTemp(OW_PORT+3, MAX_TEMP);
@@ -38,7 +39,7 @@ char temp_name[MAX_TEMP][5] = { "Air ", "?" };
 //===== setup & loop =====
 
 static Configured *(node_config[]) = {
-  &net, logger, &nettime, &owTemp, 0
+  &net, logger, &nettime, &owTemp, &rpc, 0
 };
 
 void setup() {
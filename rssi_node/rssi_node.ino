@@ -94,9 +94,9 @@ void loop() {
   }
 
   if (xmit.poll(200)) {
-    uint8_t *buf = net.alloc();
-    if (buf) {
-      net.send(0, true);
+    net_handle h = net.alloc();
+    if (h) {
+      net.send(h, 0, true);
     }
   }
 
@@ -0,0 +1,246 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Test of the EEPROM config journal (Config.cpp) on the host: the EEPROM emulation of hw.cpp
+// cuts the power after a random number of byte writes, the test then boots again, i.e. calls
+// config_init(), and checks what the modules got. "make test" builds and runs it, it prints
+// each check that fails and exits with 1 if any did.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <JeeLib.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include <Config.h>
+#include "sim.h"
+
+// hw.cpp runs nodes for the simulator, none here
+sim_params sim;
+void setup(void) {}
+void loop(void) {}
+void sim_results(sim_result *r) {}
+
+static jmp_buf lost;
+static void powerFail(void) { longjmp(lost, 1); }
+
+static int fails;
+
+// Print the message and count a failure if cond doesn't hold
+#define CHECK(cond, ...) \
+  do { if (!(cond)) { printf(__VA_ARGS__); printf("\n"); fails++; } } while (0)
+
+// A module that remembers the config it got
+class Mod : public Configured {
+public:
+  uint8_t cur[EEPROM_MAX];
+  bool dflt;                            // got applyConfig(0)
+  Mod(uint8_t id, uint8_t sz) { moduleId = id; configSize = sz; }
+  void applyConfig(uint8_t *cf) {
+    dflt = cf == 0;
+    if (cf) memcpy(cur, cf, configSize); else memset(cur, 0, configSize);
+  }
+  void receive(volatile uint8_t *pkt, uint16_t len) {}
+};
+
+static Mod a(1, 4), b(2, 1), c(6, 64), d(4, 16);
+static Configured *mods[] = { &a, &b, &c, &d, 0 };
+
+// Write module c's config over and over with a counter in it, and cut the power during one
+// write in 50: after the reboot c must have the previous or the new counter and the other
+// modules their config. Enough writes to go around the banks many times.
+static void testTear(void) {
+  sim_eeprom_erase();
+  config_init(mods);
+  uint8_t blk[EEPROM_MAX];
+  memset(blk, 0, sizeof(blk));
+  blk[0] = 42;
+  config_write(1, blk);
+  config_write(2, blk);
+  uint32_t last = 0, losses = 0;
+  for (uint32_t n=1; n<=20000; n++) {
+    memset(blk, n, sizeof(blk));
+    memcpy(blk, &n, 4);
+    sim_eeprom_left = random() % 50 == 0 ? random() % 80 : -1;
+    if (setjmp(lost) == 0) {
+      config_write(6, blk);
+      last = n;
+    } else {
+      sim_eeprom_left = -1;
+      losses++;
+      config_init(mods);
+      uint32_t got;
+      memcpy(&got, c.cur, 4);
+      CHECK(!c.dflt && (got == last || got == n), "tear: write %u got %u", n, got);
+      CHECK(!a.dflt && a.cur[0] == 42 && !b.dflt && b.cur[0] == 42,
+          "tear: write %u lost a or b", n);
+      if (got == n) last = n;
+    }
+    sim_eeprom_left = -1;
+  }
+  config_init(mods);
+  uint32_t got;
+  memcpy(&got, c.cur, 4);
+  CHECK(got == last, "tear: final %u, expected %u", got, last);
+  printf("tear: 20000 writes, %u power losses\n", losses);
+}
+
+// Lay out the configs the way the firmware from before the journal did: all blocks back to
+// back from 0x20 on, followed by a CRC of all of them
+static void writeLegacy(uint8_t fill) {
+  uint8_t *p = (uint8_t *)0x20;
+  uint16_t crc = ~0;
+  for (uint8_t i=0; mods[i]; i++) {
+    for (uint8_t j=0; j<mods[i]->configSize; j++, p++) {
+      eeprom_write_byte(p, fill+i);
+      crc = _crc16_update(crc, fill+i);
+    }
+  }
+  eeprom_write_word((uint16_t *)p, crc);
+}
+
+// Boot on the EEPROM of an older firmware, also with power losses during the import, and check
+// that every module kept its config, also across later writes and reboots
+static void testLegacy(void) {
+  for (int32_t left=0; left<=300; left += 7) {
+    sim_eeprom_erase();
+    writeLegacy(10);
+    sim_eeprom_left = left;
+    if (setjmp(lost) == 0) config_init(mods);
+    sim_eeprom_left = -1;
+    config_init(mods);
+    for (uint8_t i=0; mods[i]; i++) {
+      Mod *m = (Mod *)mods[i];
+      CHECK(!m->dflt && m->cur[0] == 10+i && m->cur[m->configSize-1] == 10+i,
+          "legacy: power loss after %d writes, module %d lost its config", left, m->moduleId);
+    }
+  }
+  // the imported configs survive a compaction, i.e. the old blocks are gone for good
+  uint8_t blk[EEPROM_MAX];
+  memset(blk, 99, sizeof(blk));
+  for (int n=0; n<100; n++) config_write(6, blk);
+  config_init(mods);
+  CHECK(!a.dflt && a.cur[0] == 10 && !d.dflt && d.cur[0] == 13 && c.cur[0] == 99,
+      "legacy: configs lost after compaction");
+  // a layout whose CRC doesn't check out, e.g. with other module sizes, isn't imported
+  sim_eeprom_erase();
+  writeLegacy(10);
+  eeprom_write_byte((uint8_t *)0x21, 0);
+  config_init(mods);
+  CHECK(a.dflt && b.dflt && c.dflt && d.dflt, "legacy: imported a layout with a bad CRC");
+  printf("legacy: import checked\n");
+}
+
+// Update the firmware: c's table shrinks to 32 bytes and d's grows to 24, b bumps its version
+// and f changes its size, both without a migration, and e is new. The tables keep the entries
+// that fit, b, e, and f get their defaults, a keeps its config, and the next boot doesn't
+// migrate again.
+static void testMigrate(void) {
+  Mod f(5, 2);
+  Configured *mods1[] = { &a, &b, &c, &d, &f, 0 };
+  sim_eeprom_erase();
+  config_init(mods1);
+  uint8_t blk[EEPROM_MAX];
+  memset(blk, 7, sizeof(blk));
+  for (uint8_t i=0; mods1[i]; i++) config_write(mods1[i]->moduleId, blk);
+  Mod b2(2, 1), c2(6, 32), d2(4, 24), e(7, 8), f2(5, 3);
+  b2.configVersion = 1;
+  c2.configResizable = d2.configResizable = true;
+  Configured *mods2[] = { &a, &b2, &c2, &d2, &e, &f2, 0 };
+  for (int boot=0; boot<2; boot++) {
+    config_init(mods2);
+    CHECK(!a.dflt && a.cur[3] == 7, "migrate: boot %d, a lost its config", boot);
+    CHECK(b2.dflt, "migrate: boot %d, b took a config of another version", boot);
+    CHECK(!c2.dflt && c2.cur[0] == 7 && c2.cur[31] == 7,
+        "migrate: boot %d, c lost its table", boot);
+    CHECK(!d2.dflt && d2.cur[15] == 7 && d2.cur[16] == 0 && d2.cur[23] == 0,
+        "migrate: boot %d, d's table didn't grow", boot);
+    CHECK(e.dflt, "migrate: boot %d, e got a config", boot);
+    CHECK(f2.dflt, "migrate: boot %d, f took a config of another size", boot);
+  }
+  // the converted table was written back with the new size
+  memset(blk, 0, sizeof(blk));
+  CHECK(config_read(6, blk) && blk[31] == 7, "migrate: c wasn't written back");
+  printf("migrate: update checked\n");
+}
+
+// Write batches of a, b, and d, and cut the power during one in three: after the reboot either
+// all three have the new config or, if the power was lost, all have the previous one. Batches
+// that repeat a module or have a block of another size are refused without writing anything.
+static void testBatch(void) {
+  sim_eeprom_erase();
+  config_init(mods);
+  uint8_t blk[EEPROM_MAX];
+  memset(blk, 0, sizeof(blk));
+  for (uint8_t i=0; mods[i]; i++) config_write(mods[i]->moduleId, blk);
+  uint32_t losses = 0;
+  for (int n=1; n<=3000; n++) {
+    uint8_t bt[EEPROM_MAX], len = 0;
+    bt[len++] = 1; bt[len++] = 4; memset(bt+len, n, 4); len += 4;
+    bt[len++] = 2; bt[len++] = 1; bt[len++] = n;
+    bt[len++] = 4; bt[len++] = 16; memset(bt+len, n, 16); len += 16;
+    bool done = true;
+    sim_eeprom_left = random() % 3 == 0 ? random() % 200 : -1;
+    if (setjmp(lost) == 0) {
+      CHECK(config_write_batch(bt, len), "batch: %d refused", n);
+    } else {
+      done = false;
+      losses++;
+    }
+    sim_eeprom_left = -1;
+    config_init(mods);
+    uint8_t now = n, prev = n-1;
+    bool all = a.cur[0] == now && b.cur[0] == now && d.cur[15] == now;
+    bool none = a.cur[0] == prev && b.cur[0] == prev && d.cur[15] == prev;
+    CHECK(all || (!done && none),
+        "batch: %d got a=%d b=%d d=%d", n, a.cur[0], b.cur[0], d.cur[15]);
+    // redo a lost batch so the next one starts from n
+    if (!all) {
+      config_write_batch(bt, len);
+      config_init(mods);
+    }
+  }
+  printf("batch: 3000 batches, %u power losses\n", losses);
+  uint8_t twice[] = { 2, 1, 5, 1, 4, 0, 0, 0, 0, 2, 1, 6 };
+  uint8_t size[] = { 2, 1, 5, 1, 3, 0, 0, 0 };
+  CHECK(!config_write_batch(twice, sizeof(twice)), "batch: took a module twice");
+  CHECK(!config_write_batch(size, sizeof(size)), "batch: took a block of another size");
+  config_init(mods);
+  CHECK(b.cur[0] == (uint8_t)3000 && a.cur[0] == (uint8_t)3000,
+      "batch: a refused batch was written");
+}
+
+// A module whose config is larger than a block may be and one that no longer fits into a bank
+// after the others get no config, i.e. applyConfig(0), and the others still get theirs
+static void testTooLarge(void) {
+  Mod big(8, EEPROM_MAX+1), late(17, 8);
+  Mod f0(10, EEPROM_MAX), f1(11, EEPROM_MAX), f2(12, EEPROM_MAX), f3(13, EEPROM_MAX),
+      f4(14, EEPROM_MAX), f5(15, EEPROM_MAX), f6(16, EEPROM_MAX);
+  Configured *mods1[] = { &big, &f0, &f1, &f2, &f3, &f4, &f5, &f6, &late, 0 };
+  sim_eeprom_erase();
+  config_init(mods1);
+  uint8_t blk[EEPROM_MAX];
+  memset(blk, 5, sizeof(blk));
+  for (uint8_t j=1; j<8; j++) config_write(mods1[j]->moduleId, blk);
+  big.dflt = late.dflt = false;
+  config_init(mods1);
+  CHECK(big.dflt && big.configSize == 0, "too large: the oversized module got a config");
+  CHECK(late.dflt && late.configSize == 0, "too large: the module left over got a config");
+  for (uint8_t j=1; j<8; j++) {
+    Mod *m = (Mod *)mods1[j];
+    CHECK(!m->dflt && m->cur[EEPROM_MAX-1] == 5, "too large: module %d lost its config",
+        m->moduleId);
+  }
+  printf("too large: checked\n");
+}
+
+int main(int argc, char **argv) {
+  sim_power_fail = powerFail;
+  srandom(1);
+  testTear();
+  testLegacy();
+  testMigrate();
+  testBatch();
+  testTooLarge();
+  printf(fails ? "configtest: %d checks failed\n" : "configtest: ok\n", fails);
+  return fails ? 1 : 0;
+}
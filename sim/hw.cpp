@@ -0,0 +1,446 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Host emulation of the Arduino core, JeeLib rf12 driver, Time library, and EEPROM for the
+// simulated nodes. Runs in each node process and talks to the simulator over a socket.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <JeeLib.h>
+#include <Time.h>
+#include <avr/eeprom.h>
+#include "sim.h"
+
+uint8_t sim_node;
+uint64_t sim_now;
+int sim_serial = -1;
+
+static uint64_t bootAt;                 // virtual time at which the node was powered up
+static uint32_t clockSkew;              // node's clock value at power-up, in us
+static int32_t clockPpm;                // how fast the node's clock runs, in ppm (sim.drift)
+static uint64_t rngState;               // per-node random number generator
+
+// ===== Arduino core =====
+
+HardwareSerial Serial;
+
+static char line[128];
+static uint8_t lineLen;
+static int peeked = -1;                 // byte read from sim_serial by peek()
+
+size_t HardwareSerial::write(uint8_t c) {
+  if (sim_serial >= 0 && ::write(sim_serial, &c, 1) != 1) _exit(1);
+  if (!sim.verbose) return 1;
+  // leave NET_SERIAL frames, which come between a pair of 0x00 delimiters, out of the log
+  static bool inFrame;
+  if (sim_serial >= 0 && c == 0) inFrame = !inFrame;
+  if (inFrame || c == 0) return 1;
+  if (c != '\n' && c != '\r' && lineLen < sizeof(line)-1) line[lineLen++] = c;
+  if (c == '\n') {
+    line[lineLen] = 0;
+    fprintf(stderr, "%10.3f n%-2d %s\n", sim_now/1000000.0, sim_node, line);
+    lineLen = 0;
+  }
+  return 1;
+}
+
+// check whether something's there first so an idle tty doesn't hold up the node
+int HardwareSerial::peek() {
+  struct pollfd pfd = { sim_serial, POLLIN, 0 };
+  uint8_t c;
+  if (peeked < 0 && sim_serial >= 0 && poll(&pfd, 1, 0) > 0 && ::read(sim_serial, &c, 1) == 1)
+    peeked = c;
+  return peeked;
+}
+
+int HardwareSerial::available() { return peek() >= 0; }
+
+int HardwareSerial::read() {
+  int c = peek();
+  peeked = -1;
+  return c;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) n += write(*buffer++);
+  return n;
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base) {
+  char buf[8 * sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  *str = 0;
+  if (base < 2) base = 10;
+  do {
+    unsigned long m = n;
+    n /= base;
+    char c = m - base * n;
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while (n);
+  return print(str);
+}
+
+size_t Print::print(const __FlashStringHelper *s) { return print((const char *)s); }
+size_t Print::print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+size_t Print::print(char c) { return write(c); }
+size_t Print::print(unsigned char b, int base) { return print((unsigned long)b, base); }
+size_t Print::print(int n, int base) { return print((long)n, base); }
+size_t Print::print(unsigned int n, int base) { return print((unsigned long)n, base); }
+size_t Print::print(unsigned long n, int base) {
+  if (base == 0) return write(n);
+  return printNumber(n, base);
+}
+size_t Print::print(long n, int base) {
+  if (base == 0) return write(n);
+  if (base == 10 && n < 0) return print('-') + printNumber(-n, 10);
+  return printNumber(n, base);
+}
+size_t Print::print(double d, int digits) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*f", digits, d);
+  return print(buf);
+}
+
+size_t Print::println(void) { return print("\r\n"); }
+size_t Print::println(const __FlashStringHelper *s) { return print(s) + println(); }
+size_t Print::println(const char *s) { return print(s) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(unsigned char b, int base) { return print(b, base) + println(); }
+size_t Print::println(int n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned int n, int base) { return print(n, base) + println(); }
+size_t Print::println(long n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned long n, int base) { return print(n, base) + println(); }
+size_t Print::println(double d, int digits) { return print(d, digits) + println(); }
+
+// the node's clock starts at a random value so nodes don't all come up with the same micros(),
+// and runs clockPpm fast like a crystal that's a bit off
+static uint64_t clockUs(void) {
+  int64_t t = sim_now - bootAt;
+  return t + t * clockPpm / 1000000 + clockSkew;
+}
+unsigned long micros(void) { return (uint32_t)clockUs(); }
+unsigned long millis(void) { return (uint32_t)(clockUs() / 1000); }
+
+// time only advances between ticks, so there's no point in waiting
+void delay(unsigned long ms) {}
+void delayMicroseconds(unsigned int us) {}
+
+uint32_t sim_random(void) {
+  // xorshift64*
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return (rngState * 2685821657736338717ULL) >> 32;
+}
+
+long random(long max) { return max <= 0 ? 0 : sim_random() % max; }
+long random(long min, long max) { return min >= max ? min : min + random(max - min); }
+void randomSeed(unsigned long seed) { rngState = seed ? seed : 1; }
+
+static uint8_t rxRssi;                  // RSSI of the last received packet
+
+// The Net library reads the RSSI as analogRead(5)-300 >> 2
+int analogRead(uint8_t pin) { return pin == 5 ? 300 + (rxRssi << 2) : 0; }
+void analogReference(uint8_t mode) {}
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+int digitalRead(uint8_t pin) { return 0; }
+
+// ===== Time library =====
+
+static time_t sysTime;
+static uint32_t prevMillis;
+static timeStatus_t status = timeNotSet;
+static getExternalTime syncProvider;
+static time_t syncInterval = 300, nextSync;
+
+time_t now(void) {
+  while (millis() - prevMillis >= 1000) {
+    sysTime++;
+    prevMillis += 1000;
+  }
+  if (syncProvider && nextSync <= sysTime) {
+    time_t t = syncProvider();
+    if (t != 0) {
+      setTime(t);
+    } else {
+      nextSync = sysTime + syncInterval;
+      if (status != timeNotSet) status = timeNeedsSync;
+    }
+  }
+  return sysTime;
+}
+
+void setTime(time_t t) {
+  sysTime = t;
+  nextSync = t + syncInterval;
+  prevMillis = millis();
+  status = timeSet;
+}
+
+void setSyncProvider(getExternalTime getTimeFunction) {
+  syncProvider = getTimeFunction;
+  nextSync = sysTime;
+  now();
+}
+
+void setSyncInterval(time_t interval) {
+  syncInterval = interval;
+  nextSync = sysTime + interval;
+}
+
+timeStatus_t timeStatus(void) { return status; }
+
+static struct tm *tm(time_t t) { return gmtime(&t); }
+int hour(time_t t) { return tm(t)->tm_hour; }
+int minute(time_t t) { return tm(t)->tm_min; }
+int second(time_t t) { return tm(t)->tm_sec; }
+int day(time_t t) { return tm(t)->tm_mday; }
+int month(time_t t) { return tm(t)->tm_mon + 1; }
+int year(time_t t) { return tm(t)->tm_year + 1900; }
+int hour(void) { return hour(now()); }
+int minute(void) { return minute(now()); }
+int second(void) { return second(now()); }
+
+// ===== EEPROM =====
+
+static uint8_t eeprom[E2END+1];
+int32_t sim_eeprom_left = -1;
+void (*sim_power_fail)(void);
+
+void sim_eeprom_erase(void) { memset(eeprom, 0xFF, sizeof(eeprom)); }
+
+uint8_t eeprom_read_byte(const uint8_t *addr) { return eeprom[(uintptr_t)addr & E2END]; }
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value) {
+  if (sim_eeprom_left == 0) sim_power_fail();
+  if (sim_eeprom_left > 0) sim_eeprom_left--;
+  eeprom[(uintptr_t)addr & E2END] = value;
+}
+
+uint16_t eeprom_read_word(const uint16_t *addr) {
+  const uint8_t *a = (const uint8_t *)addr;
+  return eeprom_read_byte(a) | (eeprom_read_byte(a+1) << 8);
+}
+
+void eeprom_write_word(uint16_t *addr, uint16_t value) {
+  uint8_t *a = (uint8_t *)addr;
+  eeprom_write_byte(a, value);
+  eeprom_write_byte(a+1, value >> 8);
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+  for (size_t i=0; i<n; i++)
+    ((uint8_t *)dst)[i] = eeprom_read_byte((const uint8_t *)src + i);
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n) {
+  for (size_t i=0; i<n; i++)
+    eeprom_write_byte((uint8_t *)dst + i, ((const uint8_t *)src)[i]);
+}
+
+// ===== RF12 driver =====
+
+volatile uint16_t rf12_crc;
+volatile uint8_t rf12_buf[3+RF12_MAXDATA+2]; // room for the CRC, like in JeeLib
+
+static uint8_t rfId, rfGroup;           // set by rf12_initialize
+static uint16_t rfRate;                 // bit rate / 10
+static uint8_t rfPower;                 // TX power reduction in steps
+static bool rxFull;                     // a packet is waiting to be picked up by rf12_recvDone
+static sim_frame rxFrame;               // ... and that's the packet
+static bool chanBusy;                   // channel busy, as reported by the simulator
+static bool txStarted;                  // a packet was started during this tick
+static sim_frame txFrame;               // ... and that's the packet
+static uint32_t overruns;               // packets lost because rxFull was set
+static bool rfAsleep;                   // turned off by rf12_sleep
+static uint64_t offSince, offSum;       // when it was turned off, total time off in us
+
+uint8_t rf12_initialize(uint8_t id, uint8_t band, uint8_t group) {
+  rfId = id & RF12_HDR_MASK;
+  rfGroup = group;
+  rfRate = 49261/10;  // rf12_initialize sets 0xC606
+  rfPower = 0;        // ... and 0x9850
+  rxFull = false;
+  return id;
+}
+
+uint16_t rf12_control(uint16_t cmd) {
+  // the data rate command: 10MHz / 29 / (R+1) / (1 + cs*7)
+  if ((cmd & 0xFF00) == 0xC600) {
+    uint8_t r = cmd & 0x7F;
+    uint32_t bps = 10000000UL / 29 / (r+1) / (cmd & 0x80 ? 8 : 1);
+    rfRate = bps / 10;
+  }
+  // the TX config command: deviation and power
+  if ((cmd & 0xFF00) == 0x9800) rfPower = cmd & 0x07;
+  return 0;
+}
+
+uint8_t rf12_recvDone(void) {
+  if (!rxFull) return 0;
+  memcpy((void *)rf12_buf, rxFrame.data, rxFrame.size);
+  rf12_crc = 0;
+  rxRssi = rxFrame.rssi;
+  rxFull = false;
+  return 1;
+}
+
+uint8_t rf12_canSend(void) {
+  return !chanBusy && !txStarted && !rxFull && !rfAsleep;
+}
+
+void rf12_sendStart(uint8_t hdr) {
+  rf12_grp = rfGroup;
+  rf12_hdr = hdr & RF12_HDR_DST ? hdr : (hdr & ~RF12_HDR_MASK) + rfId;
+  txFrame.rate = rfRate;
+  txFrame.power = rfPower;
+  txFrame.size = 3 + rf12_len;
+  memcpy(txFrame.data, (void *)rf12_buf, txFrame.size);
+  txStarted = true;
+}
+
+void rf12_sendStart(uint8_t hdr, const void *ptr, uint8_t len) {
+  rf12_len = len;
+  memcpy((void *)rf12_data, ptr, len);
+  rf12_sendStart(hdr);
+}
+
+void rf12_sendNow(uint8_t hdr, const void *ptr, uint8_t len) {
+  rf12_sendStart(hdr, ptr, len);
+}
+
+void rf12_sendWait(uint8_t mode) {}
+char rf12_sleep(char n) {
+  if (n == RF12_SLEEP && !rfAsleep) {
+    rfAsleep = true;
+    offSince = sim_now;
+  } else if (n != RF12_SLEEP && rfAsleep) {
+    rfAsleep = false;
+    offSum += sim_now - offSince;
+  }
+  return 0;
+}
+
+char rf12_lowbat(void) { return 0; }
+
+// Accept a packet from the channel if the radio would: right group and either a broadcast or
+// addressed to this node
+static void rfReceive(sim_frame *f) {
+  if (f->data[0] != rfGroup || rfAsleep) return;
+  uint8_t hdr = f->data[1];
+  if ((hdr & RF12_HDR_DST) && (hdr & RF12_HDR_MASK) != rfId && rfId != 31) return;
+  if (rxFull) {
+    overruns++;
+    return;
+  }
+  rxFrame = *f;
+  rxFull = true;
+}
+
+// ===== JeeLib timers =====
+
+byte MilliTimer::poll(word ms) {
+  byte ready = 0;
+  if (armed) {
+    word remain = next - (word)millis();
+    // since remain is unsigned, it will overflow to large values when timeout is reached
+    if (remain <= 60000) return 0;
+    ready = -remain;
+  }
+  set(ms);
+  return ready;
+}
+
+word MilliTimer::remaining() const {
+  word remain = armed ? next - (word)millis() : 0;
+  return remain <= 60000 ? remain : 0;
+}
+
+void MilliTimer::set(word ms) {
+  armed = ms != 0;
+  if (armed) next = millis() + ms - 1;
+}
+
+static void simTick(void);
+static void simReply(void);
+static int simFd = -1;                  // socket to the simulator
+
+void Sleepy::powerDown() {}
+
+// The node sleeps through the ticks, i.e. loop() doesn't run, like a powered-down MCU
+byte Sleepy::loseSomeTime(word msecs) {
+  if (simFd < 0) return 1;
+  uint64_t until = sim_now + msecs * 1000ULL;
+  while (sim_now < until) {
+    simReply();
+    simTick();
+  }
+  return 1;
+}
+
+// ===== Simulator interface =====
+
+static void xfer(int fd, void *buf, size_t len, bool out) {
+  uint8_t *p = (uint8_t *)buf;
+  while (len > 0) {
+    ssize_t n = out ? write(fd, p, len) : read(fd, p, len);
+    if (n <= 0) _exit(1); // simulator went away
+    p += n;
+    len -= n;
+  }
+}
+
+// Wait for the start of the next tick and take in the packets that arrived, at the end of
+// the run reply with the results and exit
+static void simTick(void) {
+  sim_tick t;
+  xfer(simFd, &t, sizeof(t), false);
+  sim_now = t.now;
+
+  if (t.cmd == SIM_DONE) {
+    sim_result r;
+    memset(&r, 0, sizeof(r));
+    sim_results(&r);
+    r.overruns = overruns;
+    r.radioOff = (offSum + (rfAsleep ? sim_now - offSince : 0)) / 1000;
+    xfer(simFd, &r, sizeof(r), true);
+    _exit(0);
+  }
+
+  for (uint8_t i=0; i<t.nframes; i++) {
+    sim_frame f;
+    xfer(simFd, &f, sizeof(f), false);
+    rfReceive(&f);
+  }
+  chanBusy = t.busy;
+  txStarted = false;
+}
+
+// End the tick, with the packet that was started during it
+static void simReply(void) {
+  sim_reply rp = { txStarted, rfId, rfRate };
+  xfer(simFd, &rp, sizeof(rp), true);
+  if (txStarted) xfer(simFd, &txFrame, sizeof(txFrame), true);
+}
+
+void sim_run(int fd) {
+  rngState = ((uint64_t)sim.seed << 8) + sim_node + 1;
+  clockSkew = sim_random() >> 8;
+  if (sim.drift && sim_node) clockPpm = (int32_t)(sim_random() % (2*sim.drift+1)) - sim.drift;
+  simFd = fd;
+  sim_eeprom_erase();
+  bool booted = false;
+
+  for (;;) {
+    simTick();
+    if (!booted) {
+      bootAt = sim_now;
+      setup();
+      booted = true;
+    }
+    loop();
+    simReply();
+  }
+}
@@ -0,0 +1,103 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Host emulation of the parts of the Arduino core used by the Net library, for NET_SIM builds.
+// Time is virtual: it is advanced by the simulator, see sim.h
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+#define HEX 16
+#define DEC 10
+#define OCT 8
+#define BIN 2
+
+#define INPUT 0
+#define OUTPUT 1
+#define HIGH 1
+#define LOW 0
+#define INTERNAL 3
+
+// strings live in RAM on the host
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
+#define PROGMEM
+
+class Print {
+  size_t printNumber(unsigned long n, uint8_t base);
+public:
+  virtual size_t write(uint8_t) = 0;
+  size_t write(const uint8_t *buffer, size_t size);
+
+  size_t print(const __FlashStringHelper *);
+  size_t print(const char *);
+  size_t print(char);
+  size_t print(unsigned char, int = DEC);
+  size_t print(int, int = DEC);
+  size_t print(unsigned int, int = DEC);
+  size_t print(long, int = DEC);
+  size_t print(unsigned long, int = DEC);
+  size_t print(double, int = 2);
+
+  size_t println(const __FlashStringHelper *);
+  size_t println(const char *);
+  size_t println(char);
+  size_t println(unsigned char, int = DEC);
+  size_t println(int, int = DEC);
+  size_t println(unsigned int, int = DEC);
+  size_t println(long, int = DEC);
+  size_t println(unsigned long, int = DEC);
+  size_t println(double, int = 2);
+  size_t println(void);
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() = 0;
+};
+
+// Serial output goes to stderr, prefixed with the time and node, when the simulator runs
+// verbose, else it's discarded. With NET_SERIAL the port is connected to a tty instead.
+class HardwareSerial : public Stream {
+public:
+  void begin(long) {}
+  virtual int available();
+  virtual int read();
+  virtual int peek();
+  virtual void flush() {}
+  virtual size_t write(uint8_t);
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+int analogRead(uint8_t pin);
+void analogReference(uint8_t mode);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+void setup(void);
+void loop(void);
+
+#endif // Arduino_h
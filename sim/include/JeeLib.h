@@ -0,0 +1,79 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Host emulation of the JeeLib rf12 driver and timers, for NET_SIM builds. Packets are
+// exchanged with the other simulated nodes through the simulator's shared channel, which
+// models airtime, collisions, and loss (see sim.h). The driver follows the JeeLib semantics
+// the Net library relies on: rf12_sendStart copies the payload into rf12_buf, a received
+// packet stays in rf12_buf until the next rf12_recvDone, packets addressed to other nodes or
+// groups are filtered out, and rf12_canSend is false while the channel is busy.
+
+#ifndef JeeLib_h
+#define JeeLib_h
+
+#include <Arduino.h>
+
+#define RF12_MAXDATA    66
+
+#define RF12_433MHZ     1
+#define RF12_868MHZ     2
+#define RF12_915MHZ     3
+
+#define RF12_HDR_CTL    0x80
+#define RF12_HDR_DST    0x40
+#define RF12_HDR_ACK    0x20
+#define RF12_HDR_MASK   0x1F
+
+#define RF12_SLEEP      0
+#define RF12_WAKEUP     -1
+
+extern volatile uint16_t rf12_crc;
+extern volatile uint8_t rf12_buf[];
+
+#define rf12_grp        rf12_buf[0]
+#define rf12_hdr        rf12_buf[1]
+#define rf12_len        rf12_buf[2]
+#define rf12_data       (rf12_buf + 3)
+
+uint8_t rf12_initialize(uint8_t id, uint8_t band, uint8_t group=0xD4);
+uint8_t rf12_recvDone(void);
+uint8_t rf12_canSend(void);
+void rf12_sendStart(uint8_t hdr);
+void rf12_sendStart(uint8_t hdr, const void *ptr, uint8_t len);
+void rf12_sendNow(uint8_t hdr, const void *ptr, uint8_t len);
+void rf12_sendWait(uint8_t mode);
+uint16_t rf12_control(uint16_t cmd);
+char rf12_sleep(char n);
+char rf12_lowbat(void);
+
+class MilliTimer {
+  word next;
+  byte armed;
+public:
+  MilliTimer() : armed (0) {}
+  byte poll(word ms=0);
+  word remaining() const;
+  byte idle() const { return !armed; }
+  void set(word ms);
+};
+
+class Sleepy {
+public:
+  static void powerDown();
+  static byte loseSomeTime(word msecs);
+  static void watchdogInterrupts(char mode) {}
+  static void watchdogEvent() {}
+};
+
+class Port {
+public:
+  Port(uint8_t num) {}
+  void mode(uint8_t value) const {}
+  void mode2(uint8_t value) const {}
+  void digiWrite(uint8_t value) const {}
+  void digiWrite2(uint8_t value) const {}
+  uint8_t digiRead() const { return 0; }
+  uint8_t digiRead2() const { return 0; }
+  word anaRead() const { return 0; }
+};
+
+#endif // JeeLib_h
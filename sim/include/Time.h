@@ -0,0 +1,29 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Host emulation of the Arduino Time library, for NET_SIM builds. It uses the host's time_t.
+
+#ifndef _Time_h
+#define _Time_h
+
+#include <time.h>
+
+typedef enum { timeNotSet, timeNeedsSync, timeSet } timeStatus_t;
+typedef time_t (*getExternalTime)(void);
+
+time_t now(void);
+void setTime(time_t t);
+timeStatus_t timeStatus(void);
+void setSyncProvider(getExternalTime getTimeFunction);
+void setSyncInterval(time_t interval);
+
+int hour(time_t t);
+int minute(time_t t);
+int second(time_t t);
+int day(time_t t);
+int month(time_t t);
+int year(time_t t);
+int hour(void);
+int minute(void);
+int second(void);
+
+#endif // _Time_h
@@ -0,0 +1,21 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Host emulation of the avr-libc EEPROM routines, for NET_SIM builds. Each simulated node
+// has its own 1KB EEPROM which starts out erased (all 0xFF).
+
+#ifndef _AVR_EEPROM_H_
+#define _AVR_EEPROM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define E2END 0x3FF
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+uint16_t eeprom_read_word(const uint16_t *addr);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+void eeprom_write_word(uint16_t *addr, uint16_t value);
+void eeprom_write_block(const void *src, void *dst, size_t n);
+
+#endif // _AVR_EEPROM_H_
@@ -0,0 +1,151 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Runs a node sketch (node.cpp) in real time with the Net library built for NET_SERIAL and
+// the Serial port connected to a tty, to test the serial link on Linux. Without a tty
+// argument a pty is created and its name printed, a second netser can then be started on it:
+//
+//   ./netser -g -t 30              # gateway, prints "netser: pty /dev/pts/N"
+//   ./netser -i 10 -t 30 /dev/pts/N
+//
+// The tty can also be the serial port of a wired JeeNode running a NET_SERIAL sketch, in
+// which case netser -g plays the part of the hub.
+//
+// Usage: netser [-g] [-t seconds] [-i interval_ms] [-D downlink_ms] [-b bytes] [-v] [tty]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <getopt.h>
+#include <NetAll.h>
+#include "sim.h"
+
+sim_params sim = {
+  2,          // nodes
+  30,         // seconds
+  1,          // seed
+  0,          // loss
+  false,      // collisions
+  0,          // latency
+  0,          // jitter
+  1000,       // interval
+  0,          // downlink
+  20,         // size
+  false,      // verbose
+  0,          // far
+  0,          // relays
+  0,          // sleepy
+  0,          // sense
+  0,          // drift
+  10000,      // timeInterval
+  0,          // bcast
+  0,          // rpc
+  1000,       // rpcInterval
+};
+
+static uint64_t clockUs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Put a tty into raw mode: no echo, no line editing, no translation of any bytes
+static void rawMode(int fd) {
+  struct termios t;
+  if (tcgetattr(fd, &t) < 0) return; // not a tty, e.g. a fifo
+  cfmakeraw(&t);
+  cfsetspeed(&t, B115200);
+  tcsetattr(fd, TCSANOW, &t);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: netser [options] [tty]\n"
+    "  -g              act as the gateway\n"
+    "  -t seconds      length of the run (%u)\n"
+    "  -i ms           mean interval between packets the node sends to the gateway (%u)\n"
+    "  -D ms           mean interval between packets the gateway sends to the node (%u)\n"
+    "  -b bytes        payload size of the packets (%u)\n"
+    "  -v              print the serial output\n"
+    "without tty a pty is created\n",
+    sim.seconds, sim.interval, sim.downlink, sim.size);
+  exit(1);
+}
+
+static void report(void) {
+  sim_result r;
+  memset(&r, 0, sizeof(r));
+  sim_results(&r);
+  printf("netser: %s id %u, %us, NET_WINDOW=%d NET_PKT=%d NET_AGG_MS=%d\n",
+      sim_node == 0 ? "gateway" : "node", r.nodeId, sim.seconds, NET_WINDOW, NET_PKT,
+      NET_AGG_MS);
+  printf("  sent %u, %u not sent for lack of buffers; net drops %u dups %u evicts %u "
+      "retries %u\n", r.sent, r.fails, r.drops, r.dups, r.evicts, r.retries);
+  for (uint8_t s=0; s<32; s++) {
+    sim_flow *f = &r.flow[s];
+    if (f->rcvd == 0 && f->dups == 0) continue;
+    printf("  from %2u: received %u, %u duplicates, latency avg %.1fms max %.1fms, %.0f B/s\n",
+        s, f->rcvd, f->dups, f->rcvd ? f->latSum / 1000.0 / f->rcvd : 0.0, f->latMax / 1000.0,
+        (double)f->rcvd * sim.size / sim.seconds);
+  }
+}
+
+int main(int argc, char **argv) {
+  bool gw = false;
+  int c;
+  while ((c = getopt(argc, argv, "gt:i:D:b:v")) != -1) {
+    switch (c) {
+      case 'g': gw = true; break;
+      case 't': sim.seconds = atoi(optarg); break;
+      case 'i': sim.interval = atoi(optarg); break;
+      case 'D': sim.downlink = atoi(optarg); break;
+      case 'b': sim.size = atoi(optarg); break;
+      case 'v': sim.verbose = true; break;
+      default: usage();
+    }
+  }
+  if (optind < argc-1) usage();
+
+  if (optind < argc) {
+    sim_serial = open(argv[optind], O_RDWR | O_NOCTTY);
+    if (sim_serial < 0) {
+      perror(argv[optind]);
+      exit(1);
+    }
+  } else {
+    sim_serial = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim_serial < 0 || grantpt(sim_serial) < 0 || unlockpt(sim_serial) < 0) {
+      perror("netser: pty");
+      exit(1);
+    }
+    // keep the slave side open so nothing gets lost before the other end opens it
+    if (open(ptsname(sim_serial), O_RDWR | O_NOCTTY) < 0) {
+      perror(ptsname(sim_serial));
+      exit(1);
+    }
+    printf("netser: pty %s\n", ptsname(sim_serial));
+    fflush(stdout);
+  }
+  rawMode(sim_serial);
+
+  sim_node = gw ? 0 : 1;
+  sim.seed = getpid();
+  randomSeed(sim.seed);
+  uint64_t end = clockUs() + (uint64_t)sim.seconds * 1000000;
+
+  sim_now = clockUs();
+  setup();
+  while (sim_now < end) {
+    loop();
+    // wait for input for up to a millisecond, about as often as a sketch's loop() would run
+    struct pollfd pfd = { sim_serial, POLLIN, 0 };
+    if (Serial.peek() < 0) poll(&pfd, 1, 1);
+    sim_now = clockUs();
+  }
+  report();
+  return 0;
+}
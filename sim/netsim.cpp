@@ -0,0 +1,436 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Network simulator main program: forks the nodes, runs the shared channel, and prints a
+// report at the end of the run. See sim.h for how it works and the Makefile for how to build.
+//
+// Usage: netsim [-n nodes] [-t seconds] [-s seed] [-l loss%] [-c 0|1] [-d latency_ms]
+//               [-j jitter_ms] [-i interval_ms] [-D downlink_ms] [-b bytes] [-f far]
+//               [-R relays] [-S sleepy] [-C sense_ms] [-k drift_ppm]
+//               [-T time_ms] [-B bcast_ms] [-P rpc] [-p rpc_ms] [-v] [-h]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <NetAll.h>
+#include "sim.h"
+
+sim_params sim = {
+  5,          // nodes
+  60,         // seconds
+  1,          // seed
+  0,          // loss
+  true,       // collisions
+  0,          // latency
+  0,          // jitter
+  1000,       // interval
+  0,          // downlink
+  20,         // size
+  false,      // verbose
+  0,          // far
+  0,          // relays
+  0,          // sleepy
+  0,          // sense
+  0,          // drift
+  10000,      // timeInterval
+  0,          // bcast
+  0,          // rpc
+  1000,       // rpcInterval
+  0,          // reboot
+};
+
+#define SIM_AIR  16                     // max packets in the air at the same time
+#define SIM_RX   16                     // max packets waiting to be delivered to a node
+
+// A packet in the air
+typedef struct {
+  bool     used;
+  uint8_t  src;                         // index of the sending node
+  uint64_t start, end;                  // when it's on the air, in us
+  bool     collided;                    // destroyed by an overlapping packet
+  uint32_t deaf;                        // bitmap of nodes that were transmitting at the time
+  sim_frame f;
+} air_frame;
+
+// A packet waiting to be delivered to a node
+typedef struct {
+  uint64_t at;
+  sim_frame f;
+} rx_frame;
+
+typedef struct {
+  int      fd;                          // socket to the node's process
+  pid_t    pid;
+  uint64_t bootAt;                      // when the node powers up
+  uint8_t  nodeId;                      // current rf12 id as reported by the node
+  uint8_t  rssi;                        // RSSI of the node's link to everyone else
+  rx_frame rx[SIM_RX];
+  uint8_t  rxCnt;
+  uint64_t txEnd;                       // end of the node's current transmission
+  // channel counters
+  uint32_t frames, acks, bytes;         // packets sent, of which ACKs, and bytes sent
+  uint32_t collided, lost, deaf;        // packets that didn't make it to (one of) their
+                                        // destinations: collision, loss, destination was
+                                        // transmitting at the time
+  uint64_t airtime;                     // time spent transmitting in us
+  uint32_t power;                       // sum of the TX power reduction of the packets
+  sim_result r;
+} sim_node_t;
+
+static sim_node_t nodes[SIM_MAXNODES];
+static air_frame air[SIM_AIR];
+static uint64_t rng;
+
+static uint32_t rnd(void) {
+  // xorshift64*
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return (rng * 2685821657736338717ULL) >> 32;
+}
+
+static void xfer(int fd, void *buf, size_t len, bool out) {
+  uint8_t *p = (uint8_t *)buf;
+  while (len > 0) {
+    ssize_t n = out ? write(fd, p, len) : read(fd, p, len);
+    if (n <= 0) {
+      fprintf(stderr, "netsim: lost contact with a node\n");
+      exit(1);
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+// Time a packet is on the air: preamble (3 bytes), sync (2), header, length, payload,
+// CRC (2), and tail (1), at the sender's bit rate
+static uint64_t airtime(sim_frame *f) {
+  uint32_t bits = (f->size - 1 + 3 + 2 + 2 + 1) * 8;
+  return (uint64_t)bits * 100000 / f->rate;
+}
+
+// Whether nodes i and j hear each other: the last sim.far nodes don't hear the gateway
+static bool inRange(uint8_t i, uint8_t j) {
+  uint8_t far = sim.nodes - sim.far;
+  return !((i == 0 && j >= far) || (j == 0 && i >= far));
+}
+
+// Whether node i senses a carrier: it's transmitting itself or someone in range has been for
+// sim.sense ms
+static bool busy(uint8_t i, uint64_t now) {
+  if (nodes[i].txEnd > now) return true;
+  for (uint8_t k=0; k<SIM_AIR; k++)
+    if (air[k].used && air[k].start + sim.sense * 1000ULL <= now && air[k].end > now &&
+        inRange(i, air[k].src))
+      return true;
+  return false;
+}
+
+// Put a packet on the air, marking the packets it overlaps with
+static void transmit(uint8_t i, sim_frame *f, uint64_t now) {
+  sim_node_t *n = &nodes[i];
+  uint64_t t = airtime(f);
+  n->txEnd = now + t;
+  n->frames++;
+  n->bytes += f->size - 3;
+  n->airtime += t;
+  n->power += f->power;
+  if (f->data[1] & RF12_HDR_CTL) n->acks++;
+
+  uint8_t slot = SIM_AIR;
+  for (uint8_t k=0; k<SIM_AIR; k++) {
+    air_frame *a = &air[k];
+    if (!a->used) { if (slot == SIM_AIR) slot = k; continue; }
+    if (a->end <= now || !inRange(i, a->src)) continue;
+    // overlapping packet: the sender of one can't hear the other
+    a->deaf |= 1UL << i;
+    if (sim.collisions) a->collided = true;
+  }
+  if (slot == SIM_AIR) {
+    fprintf(stderr, "netsim: too many packets in the air\n");
+    exit(1);
+  }
+
+  air_frame *a = &air[slot];
+  a->used = true;
+  a->src = i;
+  a->start = now;
+  a->end = now + t;
+  a->collided = false;
+  a->deaf = 0;
+  a->f = *f;
+  for (uint8_t k=0; k<SIM_AIR; k++) {
+    if (k == slot || !air[k].used || air[k].end <= now || !inRange(i, air[k].src)) continue;
+    a->deaf |= 1UL << air[k].src;
+    if (sim.collisions) a->collided = true;
+  }
+}
+
+// Whether node j is a destination of a packet: the addressed node, the gateway for packets
+// sent by a node with its own id, every node for the gateway's broadcasts
+static bool intended(air_frame *a, uint8_t j) {
+  uint8_t hdr = a->f.data[1];
+  if (hdr & RF12_HDR_DST) return nodes[j].nodeId == (hdr & RF12_HDR_MASK);
+  return a->src == 0 || j == 0;
+}
+
+// Deliver the packets whose transmission ended to all the nodes that could receive them
+static void propagate(uint64_t now) {
+  for (uint8_t k=0; k<SIM_AIR; k++) {
+    air_frame *a = &air[k];
+    if (!a->used || a->end > now) continue;
+    a->used = false;
+    bool coll = false, lost = false, deaf = false;
+    for (uint8_t j=0; j<sim.nodes; j++) {
+      sim_node_t *n = &nodes[j];
+      if (j == a->src || n->bootAt > a->start) continue;
+      bool want = intended(a, j);
+      if (!inRange(j, a->src)) continue;
+      if (a->deaf & (1UL << j)) { deaf |= want; continue; }
+      if (a->collided) { coll |= want; continue; }
+      if (rnd() % 1000 < sim.loss) { lost |= want; continue; }
+      // reduced TX power weakens the signal, too weak and it doesn't get through
+      int rssi = (nodes[a->src].rssi + n->rssi) / 2 - a->f.power * SIM_RSSI_STEP;
+      if (rssi < SIM_RSSI_MIN) { lost |= want; continue; }
+      if (n->rxCnt == SIM_RX) continue;
+      rx_frame *rx = &n->rx[n->rxCnt++];
+      rx->at = a->end + sim.latency*1000ULL + (sim.jitter ? rnd() % (sim.jitter*1000) : 0);
+      rx->f = a->f;
+      rx->f.rssi = rssi;
+    }
+    // the counters are kept for the sender
+    sim_node_t *n = &nodes[a->src];
+    n->collided += coll;
+    n->lost += lost;
+    n->deaf += deaf;
+  }
+}
+
+// Run one tick of a node: hand it the packets due, let it run loop(), collect what it sent
+static void tick(uint8_t i, uint64_t now) {
+  sim_node_t *n = &nodes[i];
+  sim_frame due[SIM_RX];
+  uint8_t cnt = 0;
+  for (uint8_t k=0; k<n->rxCnt; ) {
+    if (n->rx[k].at <= now) {
+      due[cnt++] = n->rx[k].f;
+      n->rx[k] = n->rx[--n->rxCnt];
+    } else {
+      k++;
+    }
+  }
+
+  sim_tick t = { SIM_TICK, busy(i, now), cnt, now };
+  xfer(n->fd, &t, sizeof(t), true);
+  for (uint8_t k=0; k<cnt; k++) xfer(n->fd, &due[k], sizeof(due[k]), true);
+
+  sim_reply rp;
+  xfer(n->fd, &rp, sizeof(rp), false);
+  n->nodeId = rp.nodeId;
+  if (rp.sent) {
+    sim_frame f;
+    xfer(n->fd, &f, sizeof(f), false);
+    transmit(i, &f, now);
+  }
+}
+
+static void usage(int status) {
+  fprintf(status ? stderr : stdout,
+    "usage: netsim [options]\n"
+    "  -n nodes        number of nodes incl. the gateway (%d, max %d)\n"
+    "  -t seconds      length of the run (%u)\n"
+    "  -s seed         random seed (%u)\n"
+    "  -l loss         random packet loss in percent, e.g. 2.5 (%.1f)\n"
+    "  -c 0|1          whether overlapping packets collide (%d)\n"
+    "  -d ms           delivery latency (%u)\n"
+    "  -j ms           random additional latency (%u)\n"
+    "  -i ms           mean interval between packets each node sends to the gateway (%u)\n"
+    "  -D ms           mean interval between packets the gateway sends to each node (%u)\n"
+    "  -b bytes        payload size of the packets (%u)\n"
+    "  -f far          number of nodes (the last ones) out of the gateway's range (%u)\n"
+    "  -R relays       number of nodes (the first ones after the gateway) that relay (%u)\n"
+    "  -S sleepy       number of nodes (the last ones) that sleep between packets (%u)\n"
+    "  -C ms           time it takes to sense the carrier of a packet (%u)\n"
+    "  -k ppm          max error of the nodes' clocks (%u)\n"
+    "  -T ms           interval between the gateway's time broadcasts, max 60000 (%u)\n"
+    "  -B ms           mean interval between packets the gateway broadcasts (%u)\n"
+    "  -P n            RPC requests the gateway keeps outstanding per node, max %d, it\n"
+    "                  also polls their counters (%u)\n"
+    "  -p ms           mean interval between RPC requests to a node, 0 sends the next one\n"
+    "                  as soon as a reply comes back (%u)\n"
+    "  -r seconds      reboot the gateway after that long, it stops queueing packets to\n"
+    "                  the nodes 5s before that and before the end of the run (%u)\n"
+    "  -v              print the serial output of the nodes\n"
+    "  -h              print this help\n",
+    sim.nodes, SIM_MAXNODES, sim.seconds, sim.seed, sim.loss/10.0, sim.collisions,
+    sim.latency, sim.jitter, sim.interval, sim.downlink, sim.size, sim.far, sim.relays,
+    sim.sleepy, sim.sense, sim.drift, sim.timeInterval, sim.bcast, SIM_RPC_MAX, sim.rpc,
+    sim.rpcInterval, sim.reboot);
+  exit(status);
+}
+
+static void report(void) {
+  uint64_t dur = sim.seconds * 1000000ULL;
+  printf("netsim: %d nodes, %us, seed %u, loss %.1f%%, collisions %s, latency %u+%ums, "
+      "carrier sense %ums\n", sim.nodes, sim.seconds, sim.seed, sim.loss/10.0,
+      sim.collisions ? "on" : "off", sim.latency, sim.jitter, sim.sense);
+  printf("        uplink every %ums, downlink every %ums, broadcast every %ums, %u bytes\n",
+      sim.interval, sim.downlink, sim.bcast, sim.size);
+  printf("        %u nodes out of the gateway's range, %u relays, %u sleepy nodes\n", sim.far,
+      sim.relays, sim.sleepy);
+  printf("        time broadcast every %ums, clocks off by up to %uppm, gateway reboot at %us\n",
+      sim.timeInterval, sim.drift, sim.reboot);
+  printf("        NET_WINDOW=%d NET_PKT=%d NET_PEERS=%d NET_AGG_MS=%d NET_RELAY=%d\n",
+      NET_WINDOW, NET_PKT, NET_PEERS, NET_AGG_MS, NET_RELAY);
+  printf("        NET_RATE=%d NET_ADAPT=%d NET_RSSI_TARGET=%d NET_SLEEPY=%d NET_CSMA_SLOT=%d\n",
+      NET_RATE, NET_ADAPT, NET_RSSI_TARGET, NET_SLEEPY, NET_CSMA_SLOT);
+  printf("        NET_TDMA=%d NET_SLOT_MS=%d NET_RBCAST=%d\n", NET_TDMA, NET_SLOT_MS,
+      NET_RBCAST);
+  printf("node id hops   sent  fail   recv   dups lat_avg lat_max frames  acks  air%% pwr off%% "
+      "coll  lost  deaf ovrun drops ndups evict retry  busy t_avg t_max\n");
+
+  uint32_t sent = 0, fails = 0, rcvd = 0, dups = 0, frames = 0, bytes = 0;
+  uint64_t latSum = 0, air = 0;
+  uint32_t latMax = 0;
+  sim_flow b;                           // broadcasts received by all the nodes
+  uint32_t nacks = 0, repairs = 0, lost = 0;
+  memset(&b, 0, sizeof(b));
+  for (uint8_t i=0; i<sim.nodes; i++) {
+    sim_node_t *n = &nodes[i];
+    sim_result *r = &n->r;
+    // what the peers got from this node: the gateway for a node, all nodes for the gateway
+    sim_flow f;
+    memset(&f, 0, sizeof(f));
+    for (uint8_t j=0; j<sim.nodes; j++) {
+      if (j == i || (i != 0 && j != 0) || r->nodeId >= 32) continue;
+      uint8_t src = i == 0 ? NET_GW_NODE : r->nodeId;
+      sim_flow *g = &nodes[j].r.flow[src];
+      f.rcvd += g->rcvd;
+      f.dups += g->dups;
+      f.latSum += g->latSum;
+      if (g->latMax > f.latMax) f.latMax = g->latMax;
+    }
+    printf("%4d %2d %4u %6u %5u %6u %6u %7.1f %7.1f %6u %5u %5.1f %3.1f %4.1f "
+        "%5u %5u %5u %5u %5u %5u %5u %5u %5u %5.1f %5.1f\n",
+        i, r->nodeId, r->hops, r->sent, r->fails, f.rcvd, f.dups,
+        f.rcvd ? f.latSum / 1000.0 / f.rcvd : 0.0, f.latMax / 1000.0,
+        n->frames, n->acks, 100.0 * n->airtime / dur,
+        n->frames ? (double)n->power / n->frames : 0.0, 100.0 * r->radioOff * 1000 / dur,
+        n->collided, n->lost, n->deaf,
+        r->overruns, r->drops, r->dups, r->evicts, r->retries, r->busy, r->timeErr / 1000.0,
+        r->timeMax / 1000.0);
+    sent += r->sent;
+    fails += r->fails;
+    rcvd += f.rcvd;
+    dups += f.dups;
+    latSum += f.latSum;
+    if (f.latMax > latMax) latMax = f.latMax;
+    frames += n->frames;
+    bytes += n->bytes;
+    air += n->airtime;
+    b.rcvd += r->flow[0].rcvd;
+    b.dups += r->flow[0].dups;
+    b.latSum += r->flow[0].latSum;
+    if (r->flow[0].latMax > b.latMax) b.latMax = r->flow[0].latMax;
+    nacks += r->nacks;
+    repairs += r->repairs;
+    lost += r->lost;
+  }
+  printf("total: delivered %u of %u sent (%.1f%%), %u not sent for lack of buffers, "
+      "%u duplicates\n", rcvd, sent, sent ? 100.0 * rcvd / sent : 0.0, fails, dups);
+  printf("       latency avg %.1fms max %.1fms, goodput %.0f B/s, %u frames, "
+      "channel busy %.1f%%\n", rcvd ? latSum / 1000.0 / rcvd : 0.0, latMax / 1000.0,
+      (double)rcvd * sim.size / sim.seconds, frames, 100.0 * air / dur);
+  if (sim.bcast) {
+    uint32_t bsent = nodes[0].r.bcasts * (sim.nodes-1);
+    printf("broadcast: delivered %u of %u (%.1f%%), %u duplicates, latency avg %.1fms "
+        "max %.1fms\n", b.rcvd, bsent, bsent ? 100.0 * b.rcvd / bsent : 0.0, b.dups,
+        b.rcvd ? b.latSum / 1000.0 / b.rcvd : 0.0, b.latMax / 1000.0);
+    printf("           %u NACKs, %u repairs, %u given up on\n", nacks, repairs, lost);
+  }
+  if (sim.rpc) {
+    sim_result *g = &nodes[0].r;
+    printf("rpc: %u requests, %u replies, %u timed out, round trip avg %.1fms max %.1fms, "
+        "%.1f replies/s\n", g->rpcSent, g->rpcOk, g->rpcLost,
+        g->rpcOk ? g->rpcRttSum / 1000.0 / g->rpcOk : 0.0, g->rpcRttMax / 1000.0,
+        (double)g->rpcOk / sim.seconds);
+    printf("     %u counter polls, %u replies\n", g->statsPolls, g->statsReplies);
+  }
+}
+
+int main(int argc, char **argv) {
+  int c;
+  while ((c = getopt(argc, argv, "n:t:s:l:c:d:j:i:D:b:f:R:S:C:k:T:B:P:p:r:vh")) != -1) {
+    switch (c) {
+    case 'n': sim.nodes = atoi(optarg); break;
+    case 't': sim.seconds = atoi(optarg); break;
+    case 's': sim.seed = atoi(optarg); break;
+    case 'l': sim.loss = atof(optarg) * 10 + 0.5; break;
+    case 'c': sim.collisions = atoi(optarg) != 0; break;
+    case 'd': sim.latency = atoi(optarg); break;
+    case 'j': sim.jitter = atoi(optarg); break;
+    case 'i': sim.interval = atoi(optarg); break;
+    case 'D': sim.downlink = atoi(optarg); break;
+    case 'b': sim.size = atoi(optarg); break;
+    case 'f': sim.far = atoi(optarg); break;
+    case 'R': sim.relays = atoi(optarg); break;
+    case 'S': sim.sleepy = atoi(optarg); break;
+    case 'C': sim.sense = atoi(optarg); break;
+    case 'k': sim.drift = atoi(optarg); break;
+    case 'T': sim.timeInterval = atoi(optarg) > 60000 ? 0 : atoi(optarg); break;
+    case 'B': sim.bcast = atoi(optarg); break;
+    case 'P': sim.rpc = atoi(optarg) > SIM_RPC_MAX ? 0xFF : atoi(optarg); break;
+    case 'p': sim.rpcInterval = atoi(optarg); break;
+    case 'r': sim.reboot = atoi(optarg); break;
+    case 'v': sim.verbose = true; break;
+    case 'h': usage(0); break;
+    default: usage(1);
+    }
+  }
+  if (optind < argc || sim.nodes < 1 || sim.nodes > SIM_MAXNODES || sim.loss > 1000 ||
+      sim.far >= sim.nodes || sim.timeInterval == 0 || sim.timeInterval > 60000 ||
+      sim.rpc > SIM_RPC_MAX)
+    usage(1);
+  if (sim.nodes > NET_PEERS)
+    fprintf(stderr, "netsim: warning: NET_PEERS=%d is too small for the gateway\n", NET_PEERS);
+  rng = ((uint64_t)sim.seed << 8) | 0xA5;
+
+  // nodes power up at random times during the first second, the gateway first
+  for (uint8_t i=0; i<sim.nodes; i++) {
+    sim_node_t *n = &nodes[i];
+    n->bootAt = i == 0 ? 0 : (rnd() % 1000) * 1000ULL;
+    n->rssi = 40 + rnd() % 120;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { perror("socketpair"); return 1; }
+    fflush(stdout);
+    n->pid = fork();
+    if (n->pid < 0) { perror("fork"); return 1; }
+    if (n->pid == 0) {
+      close(sv[0]);
+      for (uint8_t j=0; j<i; j++) close(nodes[j].fd);
+      sim_node = i;
+      sim_run(sv[1]);
+    }
+    close(sv[1]);
+    n->fd = sv[0];
+  }
+
+  uint64_t end = sim.seconds * 1000000ULL;
+  for (uint64_t now=0; now<end; now+=SIM_TICK_US) {
+    propagate(now);
+    for (uint8_t i=0; i<sim.nodes; i++)
+      if (nodes[i].bootAt <= now) tick(i, now);
+  }
+
+  for (uint8_t i=0; i<sim.nodes; i++) {
+    sim_tick t = { SIM_DONE, 0, 0, end };
+    xfer(nodes[i].fd, &t, sizeof(t), true);
+    xfer(nodes[i].fd, &nodes[i].r, sizeof(nodes[i].r), false);
+    waitpid(nodes[i].pid, 0, 0);
+  }
+  report();
+  return 0;
+}
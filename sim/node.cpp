@@ -0,0 +1,417 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Sketch run by each simulated node. Node 0 is the gateway: it plays the management server
+// by answering announcements with an init packet that assigns a node id, broadcasts the time,
+// and optionally sends packets down to each node, broadcasts packets to all of them (with
+// rbcast if NET_RBCAST > 0), and keeps RPC requests outstanding to each node that read the
+// link state and the config of its modules (and, with RPC_SNAP_BUF > 0, also take config
+// snapshots and write config batches) while polling its counters with plain NET_CMD_STATS
+// packets. The other nodes send SIM_MODULE packets to the gateway. A
+// SIM_MODULE packet carries a 16-bit sequence number and the virtual time at which it was
+// handed to Net, so the receiver can count losses, duplicates, and latency.
+
+#include <new>
+#include <NetAll.h>
+#include "sim.h"
+
+// The module receiving SIM_MODULE packets, so they can be aggregated like any other
+class SimApp : public Configured {
+public:
+  SimApp(void) { moduleId = SIM_MODULE; configSize = 0; }
+  virtual void applyConfig(uint8_t *) {}
+  virtual void receive(volatile uint8_t *pkt, uint16_t len);
+};
+
+// The gateway's end of the RPC requests, it plays the management server and gets the replies
+class SimHub : public Configured {
+public:
+  SimHub(void) { moduleId = RPC_MODULE; configSize = 0; }
+  virtual void applyConfig(uint8_t *) {}
+  virtual void receive(volatile uint8_t *pkt, uint16_t len);
+};
+
+Net net(0xD4, false);
+NetTime nettime;
+Log l, *logger=&l;
+SimApp app;
+SimHub hub;
+#if RPC_SNAP_BUF > 0
+NetFrag frag;
+NetRpc rpc(&frag);
+
+static Configured *node_config[] = {
+  &net, logger, &nettime, &app, &rpc, &frag, 0
+};
+static Configured *gw_config[] = {
+  &net, logger, &nettime, &app, &hub, &frag, 0
+};
+#else
+NetRpc rpc;
+
+static Configured *node_config[] = {
+  &net, logger, &nettime, &app, &rpc, 0
+};
+static Configured *gw_config[] = {
+  &net, logger, &nettime, &app, &hub, 0
+};
+#endif
+
+static uint16_t txSeq[32];              // next sequence number per destination
+static uint32_t txAt[32];               // when to send the next packet, per destination
+static uint32_t sent, fails, bcasts;
+static uint32_t bcastAt;                // gateway: when to broadcast the next packet
+static sim_flow flow[32];               // per source, 0 for broadcasts from the gateway
+static uint8_t *seen[32];               // per source bitmap of the sequence numbers received
+static uint16_t uuids[32];              // gateway: uuid of the node each id is assigned to
+static MilliTimer timeTimer, errTimer;
+static uint64_t errSum;                 // sum of the samples of NetTime's error in us
+static uint32_t errCnt, errMax;         // number of samples, max error in us
+
+// Gateway: outstanding RPC requests per node, indexed by the request id modulo SIM_RPC_MAX
+typedef struct {
+  uint8_t  id;                          // request id
+  uint32_t at;                          // when it was sent, 0 if the entry is unused
+} sim_rpc;
+static sim_rpc rpcReq[32][SIM_RPC_MAX];
+static uint8_t rpcId[32];               // id of the next request per node
+static uint8_t rpcOut[32];              // number of requests outstanding per node
+static uint32_t rpcAt[32];              // when the next request to each node may go out
+static uint32_t rpcSent, rpcOk, rpcLost, rpcRttMax;
+static uint64_t rpcRttSum;
+static uint32_t statsAt[32];            // gateway: when to poll the counters of each node
+static bool heard[32];                  // gateway: whether a node has sent with its id yet
+static uint32_t statsPolls, statsReplies; // gateway: NET_CMD_STATS packets sent and received
+static bool rebooted;                   // gateway: whether it rebooted yet (sim.reboot)
+
+// Pick the time for the next packet, uniformly distributed around the mean interval
+static uint32_t nextAt(uint32_t interval) {
+  return millis() + interval/2 + random(interval+1);
+}
+
+// Send a SIM_MODULE packet to the gateway (hdr 0), to the node in hdr, or broadcast it
+// (dest 0 at the gateway)
+static void simSend(uint8_t dest, uint8_t hdr) {
+  net_handle h = net.alloc(NET_PRIO_TELEM);
+  if (!h) {
+    fails++;
+    return;
+  }
+  uint8_t *pkt = net.data(h);
+  uint8_t len = sim.size < 7 ? 7 : sim.size;
+  if (len > NET_MAXDATA) len = NET_MAXDATA;
+  memset(pkt, 0, len);
+  pkt[0] = SIM_MODULE;
+  memcpy(pkt+1, &txSeq[dest], 2);
+  uint32_t t = sim_now / 1000;
+  memcpy(pkt+3, &t, 4);
+  if (hdr) {
+    net.rawSend(h, len, hdr);
+  } else if (sim_node == 0) {
+#if NET_RBCAST > 0
+    if (len > NET_MAXDATA-NET_RB_HDR) len = NET_MAXDATA-NET_RB_HDR;
+    net.rbcast(h, len);
+#else
+    net.bcast(h, len);
+#endif
+    txSeq[dest]++;
+    bcasts++;
+    return;
+  } else {
+    net.send(h, len, true);
+  }
+  txSeq[dest]++;
+  sent++;
+}
+
+// Account for a received SIM_MODULE packet, the sender is identified by the rf12 header
+void SimApp::receive(volatile uint8_t *pkt, uint16_t len) {
+  if (len < 6) return;
+  uint8_t src = rf12_hdr & RF12_HDR_DST ? NET_GW_NODE : rf12_hdr & RF12_HDR_MASK;
+  if (src == NET_GW_NODE && !(rf12_hdr & RF12_HDR_DST)) src = 0;
+  uint16_t seq;
+  uint32_t t;
+  memcpy(&seq, (uint8_t *)pkt, 2);
+  memcpy(&t, (uint8_t *)pkt+2, 4);
+
+  if (!seen[src]) seen[src] = (uint8_t *)calloc(65536/8, 1);
+  sim_flow *f = &flow[src];
+  if (seen[src][seq>>3] & (1 << (seq & 7))) {
+    f->dups++;
+    return;
+  }
+  seen[src][seq>>3] |= 1 << (seq & 7);
+  f->rcvd++;
+  uint32_t lat = sim_now - (uint64_t)t * 1000;
+  f->latSum += lat;
+  if (lat > f->latMax) f->latMax = lat;
+}
+
+// Gateway: account for the reply to an RPC request
+void SimHub::receive(volatile uint8_t *pkt, uint16_t len) {
+  if (len < RPC_HDR-1 || !(pkt[2] & RPC_REPLY)) return;
+  uint8_t src = rf12_hdr & RF12_HDR_MASK;
+  sim_rpc *r = &rpcReq[src][pkt[0] % SIM_RPC_MAX];
+  if (r->at == 0 || r->id != pkt[0]) return; // timed out
+  // a snapshot must consist of whole records: module id, version, size, config block
+  uint16_t i = RPC_HDR-1;
+  if (pkt[1] == 0) while (i+3 <= len) i += 3+pkt[i+2];
+  if (pkt[2] == (RPC_REPLY|RPC_OK) && (pkt[1] != 0 || i == len)) {
+    uint32_t rtt = (millis() - r->at) * 1000;
+    rpcRttSum += rtt;
+    if (rtt > rpcRttMax) rpcRttMax = rtt;
+    rpcOk++;
+  }
+  r->at = 0;
+  rpcOut[src]--;
+}
+
+// Gateway: keep up to sim.rpc requests outstanding to a node, sent sim.rpcInterval apart on
+// average, one in four reads the link state (NET_CMD_PEERS) of its Net module, the others read
+// the config of one of its modules
+static void rpcSend(uint8_t id) {
+  static const uint8_t modules[] = { NET_MODULE, NET_MODULE, LOG_MODULE, NETTIME_MODULE };
+  for (uint8_t i=0; i<SIM_RPC_MAX; i++) {
+    sim_rpc *r = &rpcReq[id][i];
+    if (r->at != 0 && millis() - r->at >= SIM_RPC_MS) {
+      r->at = 0;
+      rpcOut[id]--;
+      rpcLost++;
+    }
+  }
+  while (rpcOut[id] < sim.rpc) {
+    if (sim.rpcInterval && (int32_t)(millis() - rpcAt[id]) < 0) return;
+    sim_rpc *r = &rpcReq[id][rpcId[id] % SIM_RPC_MAX];
+    if (r->at != 0) return;
+    net_handle h = net.alloc(NET_PRIO_CTL);
+    if (!h) return;
+    uint8_t *pkt = net.data(h);
+    pkt[0] = RPC_MODULE;
+    pkt[1] = rpcId[id];
+    pkt[2] = modules[rpcId[id] % sizeof(modules)];
+    pkt[3] = RPC_READ;
+    uint8_t len = RPC_HDR;
+    if (rpcId[id] % 4 == 0) {
+      pkt[3] = RPC_CALL;
+      pkt[len++] = NET_CMD_PEERS;
+    }
+#if RPC_SNAP_BUF > 0
+    // every 4th request takes a snapshot, the one before writes a batch: the time zone
+    // offset of NetTime and the gateway's own Log config
+    if (rpcId[id] % 4 == 3) {
+      pkt[2] = 0;
+      pkt[3] = RPC_SNAPSHOT;
+    } else if (rpcId[id] % 4 == 2) {
+      pkt[2] = 0;
+      pkt[3] = RPC_BATCH;
+      pkt[len++] = NETTIME_MODULE; pkt[len++] = 1; pkt[len++] = 0;
+      pkt[len++] = LOG_MODULE; pkt[len++] = 1;
+      config_read(LOG_MODULE, pkt+len++);
+    }
+#endif
+    net.rawSend(h, len, RF12_HDR_DST|RF12_HDR_ACK|id);
+    r->id = rpcId[id]++;
+    r->at = millis() | 1;
+    rpcOut[id]++;
+    rpcSent++;
+    if (sim.rpcInterval) rpcAt[id] = nextAt(sim.rpcInterval);
+  }
+}
+
+// Gateway: poll the counters of a node every SIM_STATS_MS the way the management server does
+// without RPC, the node replies with net.send(), i.e. the reply may get aggregated
+static void statsPoll(uint8_t id) {
+  if ((int32_t)(millis() - statsAt[id]) < 0) return;
+  net_handle h = net.alloc(NET_PRIO_CTL);
+  if (!h) return;
+  uint8_t *pkt = net.data(h);
+  pkt[0] = NET_MODULE;
+  pkt[1] = NET_CMD_STATS;
+  net.rawSend(h, 2, RF12_HDR_DST|RF12_HDR_ACK|id);
+  statsAt[id] = millis() + SIM_STATS_MS;
+  statsPolls++;
+}
+
+// Gateway: count the replies to the counter polls, also those that came aggregated
+static void statsCount(void) {
+  if (rf12_data[0] == NET_MODULE) {
+    if (rf12_len >= 2 && rf12_data[1] == NET_CMD_STATS) statsReplies++;
+  } else if (rf12_data[0] == AGG_MODULE) {
+    for (uint8_t i=1; i+2 < rf12_len; i += 2+rf12_data[i+1])
+      if (rf12_data[i] == NET_MODULE && rf12_data[i+2] == NET_CMD_STATS) statsReplies++;
+  }
+}
+
+// Gateway: answer the announcement of an uninitialized node with an init packet
+// Format: module(8), uuid(16), node_id(8), enabled(8), slot(8) with NET_TDMA
+static void gwInit(void) {
+  uint16_t uuid;
+  memcpy(&uuid, (uint8_t *)rf12_data+1, 2);
+  uint8_t id;
+  for (id=NET_GW_NODE+1; id<NET_UNINIT_NODE; id++)
+    if (uuids[id] == uuid || uuids[id] == 0) break;
+  if (id == NET_UNINIT_NODE) return;
+  uuids[id] = uuid;
+
+  net_handle h = net.alloc(NET_PRIO_CTL);
+  if (!h) return;
+  uint8_t *pkt = net.data(h);
+  pkt[0] = NET_MODULE;
+  memcpy(pkt+1, &uuid, 2);
+  pkt[3] = id;
+  pkt[4] = 1;
+#if NET_TDMA > 0
+  // slots in the order the nodes show up
+  pkt[5] = 1 + (id-NET_GW_NODE-1) % (NET_TDMA-1);
+  net.rawSend(h, 6, RF12_HDR_DST|NET_UNINIT_NODE);
+#else
+  net.rawSend(h, 5, RF12_HDR_DST|NET_UNINIT_NODE);
+#endif
+}
+
+// Gateway: start over with a fresh Net, which numbers its packets afresh like after a power
+// cycle, while the management server it plays keeps its state
+static void gwReboot(void) {
+  net.~Net();
+  new (&net) Net(0xD4, false);
+  uint8_t cf[EEPROM_MAX];
+  net.applyConfig(config_read(NET_MODULE, cf) ? cf : 0);
+  net.setNodeId(NET_GW_NODE);
+  node_enabled = true;
+  rebooted = true;
+  Serial.println(F("***** REBOOT"));
+}
+
+void setup() {
+  Serial.begin(57600);
+  Serial.println(F("***** SETUP: " __FILE__));
+  config_init(sim_node == 0 ? gw_config : node_config);
+  if (sim_node == 0) {
+    net.setNodeId(NET_GW_NODE);
+    node_enabled = true;
+    NetTime::set(SIM_EPOCH, 0);
+  }
+#if NET_RELAY > 0
+  if (sim_node != 0 && sim_node <= sim.relays) net.setRelay(true);
+#endif
+#if NET_SLEEPY > 0
+  if (sim_node != 0 && sim_node >= sim.nodes - sim.sleepy) net.setSleepy(true);
+#endif
+  for (uint8_t i=0; i<32; i++) {
+    txSeq[i] = random(65536);
+    txAt[i] = nextAt(sim_node == 0 ? sim.downlink : sim.interval);
+  }
+  if (sim.bcast) bcastAt = nextAt(sim.bcast);
+}
+
+void loop() {
+  if (net.poll()) {
+    if (sim_node == 0) {
+      statsCount();
+      if (!(rf12_hdr & RF12_HDR_DST)) heard[rf12_hdr & RF12_HDR_MASK] = true;
+    }
+    if (sim_node == 0 && !(rf12_hdr & RF12_HDR_DST) &&
+        (rf12_hdr & RF12_HDR_MASK) == NET_UNINIT_NODE && rf12_len == 3 &&
+        rf12_data[0] == NET_MODULE)
+      gwInit();
+    else if (sim_node != 0 || rf12_data[0] == SIM_MODULE || rf12_data[0] == AGG_MODULE ||
+             rf12_data[0] == RPC_MODULE || rf12_data[0] == FRAG_MODULE)
+      config_dispatch();
+  }
+
+#if RPC_SNAP_BUF > 0
+  frag.poll();
+#endif
+
+  // nodes compare NetTime's clock to the gateway's, which is the virtual time
+  if (sim_node != 0 && errTimer.poll(1000) && NetTime::get(0) != 0) {
+    uint16_t ms;
+    int64_t t = NetTime::get(&ms);
+    int64_t err = ((t - SIM_EPOCH) * 1000 + ms) * 1000 - (int64_t)sim_now;
+    if (err < 0) err = -err;
+    errSum += err;
+    errCnt++;
+    if (err > errMax) errMax = err;
+  }
+
+  if (sim_node == 0) {
+    // packets queued in the last seconds before the reboot would be lost with it, and those
+    // before the end of the run couldn't be told apart from lost ones
+    bool quiet = sim.reboot &&
+                 sim_now + 5000000ULL >= (rebooted ? sim.seconds : sim.reboot) * 1000000ULL;
+    if (sim.reboot && !rebooted && sim_now >= sim.reboot * 1000000ULL) gwReboot();
+    // broadcast the time, like eth_node does when it gets an NTP response
+    if (timeTimer.poll(sim.timeInterval)) {
+      net_handle h = net.alloc(NET_PRIO_CTL);
+      if (h) {
+        uint8_t *pkt = net.data(h);
+        // Net puts the time into the packet when it's sent
+        pkt[0] = NETTIME_MODULE;
+        memset(pkt+1, 0, 6);
+#if NET_RBCAST > 0
+        net.rbcast(h, 7);
+#else
+        net.bcast(h, 7);
+#endif
+      }
+    }
+    if (sim.bcast && (int32_t)(millis() - bcastAt) >= 0) {
+      simSend(0, 0);
+      bcastAt = nextAt(sim.bcast);
+    }
+    // downlink traffic to the nodes that have an id
+    for (uint8_t id=NET_GW_NODE+1; sim.downlink && !quiet && id<NET_UNINIT_NODE && uuids[id];
+         id++) {
+      if ((int32_t)(millis() - txAt[id]) >= 0) {
+        simSend(id, RF12_HDR_DST|RF12_HDR_ACK|id);
+        txAt[id] = nextAt(sim.downlink);
+      }
+    }
+    // requests to a node that hasn't picked up its init packet yet would only tie up the
+    // gateway's buffers with retries
+    for (uint8_t id=NET_GW_NODE+1; sim.rpc && id<NET_UNINIT_NODE && uuids[id]; id++) {
+      if (!heard[id]) continue;
+      statsPoll(id);
+      rpcSend(id);
+    }
+  } else if (sim.interval && node_enabled && node_id != NET_UNINIT_NODE) {
+    if ((int32_t)(millis() - txAt[0]) >= 0) {
+      simSend(0, 0);
+      txAt[0] = nextAt(sim.interval);
+    }
+#if NET_SLEEPY > 0
+    // battery-powered nodes sleep until the next packet is due
+    int32_t d = txAt[0] - millis();
+    if (sim_node >= sim.nodes - sim.sleepy && d > 0) net.sleep(d);
+#endif
+  }
+}
+
+void sim_results(sim_result *r) {
+  r->nodeId = node_id;
+  r->sent = sent;
+  r->fails = fails;
+  r->bcasts = bcasts;
+  r->drops = net.stats.drops;
+  r->dups = net.stats.dups;
+  r->evicts = net.stats.evicts;
+  r->retries = net.stats.retries;
+  r->busy = net.stats.busy;
+  r->nacks = net.stats.nacks;
+  r->repairs = net.stats.repairs;
+  r->lost = net.stats.lost;
+  r->timeErr = errCnt ? errSum / errCnt : 0;
+  r->timeMax = errMax;
+  r->rpcSent = rpcSent;
+  r->rpcOk = rpcOk;
+  r->rpcLost = rpcLost;
+  r->rpcRttSum = rpcRttSum;
+  r->rpcRttMax = rpcRttMax;
+  r->statsPolls = statsPolls;
+  r->statsReplies = statsReplies;
+#if NET_RELAY > 0
+  r->hops = node_id == NET_GW_NODE ? 0 : net.hops;
+#else
+  r->hops = node_id == NET_GW_NODE ? 0 : 1;
+#endif
+  memcpy(r->flow, flow, sizeof(flow));
+}
@@ -0,0 +1,127 @@
+// Copyright (c) 2013 Thorsten von Eicken
+//
+// Discrete-event network simulator for the Net library (NET_SIM builds).
+//
+// Every simulated node is a separate process forked from the simulator, so each one has its
+// own copy of the Net library's globals, its own EEPROM, and its own clock. The simulator
+// owns virtual time and advances it in 1ms ticks: each tick it hands every node the packets
+// that arrived for it and whether the channel is busy, the node runs loop() once and replies
+// with the packet it started to transmit, if any. The shared channel models airtime at the
+// sender's bit rate, collisions between overlapping packets, half-duplex radios, random loss,
+// and propagation plus processing latency.
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <JeeLib.h>
+
+#define SIM_MAXNODES   24               // max number of nodes, including the gateway
+#define SIM_TICK_US    1000             // length of a tick
+#define SIM_MODULE     0x7F             // module id of the packets generated by the sim nodes
+#define SIM_RSSI_STEP  10               // RSSI lost per step of TX power reduction (2.5dB)
+#define SIM_RSSI_MIN   30               // packets received weaker than that are lost
+#define SIM_EPOCH      1370000000       // time the gateway's clock is set to at the start
+#define SIM_RPC_MAX    8                // max RPC requests outstanding per node
+#define SIM_RPC_MS     3000             // time after which an RPC request is given up on
+#define SIM_STATS_MS   5000             // interval at which the gw polls the nodes' counters
+
+// Parameters of a simulation run, set by the simulator before it forks the nodes
+typedef struct {
+  uint8_t  nodes;                       // number of nodes, node 0 is the gateway
+  uint32_t seconds;                     // length of the run
+  uint32_t seed;                        // random seed, runs with the same seed are identical
+  uint16_t loss;                        // random packet loss per receiver, in 0.1%
+  bool     collisions;                  // whether overlapping packets destroy each other
+  uint16_t latency;                     // fixed delivery latency in ms
+  uint16_t jitter;                      // random additional latency in ms
+  uint32_t interval;                    // mean ms between packets a node sends to the gw
+  uint32_t downlink;                    // mean ms between packets the gw sends to each node
+  uint8_t  size;                        // payload size of the generated packets
+  bool     verbose;                     // print the nodes' serial output
+  uint8_t  far;                         // the last far nodes are out of the gateway's range
+  uint8_t  relays;                      // nodes 1..relays relay for the others (NET_RELAY)
+  uint8_t  sleepy;                      // the last sleepy nodes sleep (NET_SLEEPY)
+  uint8_t  sense;                       // ms it takes to sense the carrier of a packet
+  uint16_t drift;                       // max error of the nodes' clocks in ppm, the gw's is 0
+  uint16_t timeInterval;                // ms between the gateway's time broadcasts
+  uint32_t bcast;                       // mean ms between packets the gw broadcasts, 0=none
+  uint8_t  rpc;                         // RPC requests the gw keeps outstanding per node
+  uint32_t rpcInterval;                 // mean ms between RPC requests to a node, 0=no pause
+  uint32_t reboot;                      // second at which the gateway reboots, 0=never
+} sim_params;
+
+extern sim_params sim;                  // parameters of this run
+extern uint8_t sim_node;                // index of this node, in the node processes
+extern uint64_t sim_now;                // current virtual time in us
+extern int sim_serial;                  // tty the Serial port is connected to, -1 if none
+
+// A packet on the channel, data has the rf12_buf layout: group, header, length, payload
+typedef struct {
+  uint16_t rate;                        // bit rate in bits per second / 10
+  uint8_t  rssi;                        // RSSI the receiver will measure
+  uint8_t  power;                       // TX power reduction in steps
+  uint8_t  size;                        // number of bytes in data
+  uint8_t  data[3+RF12_MAXDATA];
+} sim_frame;
+
+// Simulator -> node: the start of a tick, followed by nframes sim_frame
+#define SIM_TICK       1
+#define SIM_DONE       2                // end of the run, node replies with its sim_result
+typedef struct {
+  uint8_t  cmd;
+  uint8_t  busy;                        // channel busy (carrier sense)
+  uint8_t  nframes;                     // packets received during the tick
+  uint64_t now;                         // virtual time in us
+} sim_tick;
+
+// Node -> simulator: the end of a tick, followed by a sim_frame if sent
+typedef struct {
+  uint8_t  sent;                        // whether a packet was started
+  uint8_t  nodeId;                      // current rf12 node id
+  uint16_t rate;                        // current bit rate / 10
+} sim_reply;
+
+// Per-source counters kept by each node of the SIM_MODULE packets it received
+typedef struct {
+  uint32_t rcvd;                        // packets delivered to the application
+  uint32_t dups;                        // packets delivered more than once
+  uint64_t latSum;                      // sum of the latencies in us
+  uint32_t latMax;                      // max latency in us
+} sim_flow;
+
+// Node -> simulator: counters at the end of the run
+typedef struct {
+  uint8_t  nodeId;                      // rf12 node id
+  uint32_t sent;                        // SIM_MODULE packets handed to Net
+  uint32_t fails;                       // SIM_MODULE packets Net had no buffer for
+  uint32_t bcasts;                      // SIM_MODULE packets broadcast (gateway)
+  uint32_t overruns;                    // packets lost because the rf12 buffer was full
+  uint16_t drops, dups, evicts;         // net_stats
+  uint16_t retries, busy;               // net_stats
+  uint16_t nacks, repairs, lost;        // net_stats (NET_RBCAST)
+  uint8_t  hops;                        // transmissions to the gateway (NET_RELAY)
+  uint32_t radioOff;                    // time the radio was turned off in ms
+  uint32_t timeErr, timeMax;            // avg and max error of NetTime's clock in us
+  uint32_t rpcSent, rpcOk, rpcLost;     // gateway: RPC requests, replies, and timeouts
+  uint64_t rpcRttSum;                   // sum of the round-trip times of the replies in us
+  uint32_t rpcRttMax;                   // max round-trip time in us
+  uint32_t statsPolls, statsReplies;    // gateway: NET_CMD_STATS polls sent, replies received
+  sim_flow flow[32];                    // indexed by source node id, 0 for broadcasts
+} sim_result;
+
+// Implemented by the simulated sketch (node.cpp)
+void sim_results(sim_result *r);
+
+// Implemented by the emulation layer (hw.cpp), runs a node process until SIM_DONE
+void sim_run(int fd);
+uint32_t sim_random(void);
+
+// EEPROM power-loss emulation for configtest: the number of byte writes left until the power
+// fails, -1 for never. The write that finds it at 0 calls sim_power_fail() instead, which
+// doesn't return.
+extern int32_t sim_eeprom_left;
+extern void (*sim_power_fail)(void);
+void sim_eeprom_erase(void);
+
+#endif // SIM_H